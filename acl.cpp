@@ -0,0 +1,275 @@
+#include "acl.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+const unsigned char lowerTable[256] = {
+#define ROW(base) (unsigned char) (base), (unsigned char) (base + 1), (unsigned char) (base + 2), \
+        (unsigned char) (base + 3), (unsigned char) (base + 4), (unsigned char) (base + 5), \
+        (unsigned char) (base + 6), (unsigned char) (base + 7)
+        ROW(0), ROW(8), ROW(16), ROW(24), ROW(32), ROW(40), ROW(48), ROW(56),
+        64, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o',
+        'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z', 91, 92, 93, 94, 95,
+        ROW(96), ROW(104), ROW(112), ROW(120), ROW(128), ROW(136), ROW(144), ROW(152),
+        ROW(160), ROW(168), ROW(176), ROW(184), ROW(192), ROW(200), ROW(208), ROW(216),
+        ROW(224), ROW(232), ROW(240), ROW(248)
+#undef ROW
+};
+
+//labels order bytewise with a prefix first, the order the compiler sorts reversed names in
+int compareLabel(const char *host, size_t hostLength, const AclNode &node, const char *labels) {
+    size_t common = min(hostLength, (size_t) node.length);
+    for (size_t i = 0; i < common; ++i) {
+        char byte = i < sizeof(node.prefix) ? node.prefix[i] : labels[node.label + i];
+        int difference = (int) lowerTable[(unsigned char) host[i]] - (int) (unsigned char) byte;
+        if (difference != 0) {
+            return difference;
+        }
+    }
+    return hostLength < node.length ? -1 : (hostLength > node.length ? 1 : 0);
+}
+
+struct Rule {
+    //labels from last to first, each followed by '\0', so that a name sorts right before the names below it
+    string key;
+    bool suffix;
+    aclAction action;
+};
+
+aclAction parseAction(const string &word) {
+    return word == "allow" ? aclAction::allow : (word == "block" ? aclAction::block : aclAction::none);
+}
+
+}
+
+Acl::Acl(const string &path) : mapped(MAP_FAILED), mappedSize(0) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw runtime_error("Unable to open ACL file." + string(strerror(errno)));
+    }
+    mappedSize = (size_t) status.st_size;
+    if (mappedSize >= sizeof(AclHeader)) {
+        mapped = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    }
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        throw runtime_error("Unable to map ACL file.");
+    }
+
+    header = (const AclHeader *) mapped;
+    nodes = (const AclNode *) (header + 1);
+    uint64_t expected = sizeof(AclHeader) + ((uint64_t) header->nodes + 1) * sizeof(AclNode) + header->labelBytes;
+    bool valid = memcmp(header->magic, "PXAL", 4) == 0 && header->version == version && header->nodes != 0 &&
+                 expected == mappedSize && header->defaultAction <= (uint8_t) aclAction::block;
+    labels = (const char *) (nodes + (valid ? header->nodes + 1 : 0));
+    //children after their parent keep every walk finite, whatever the file says
+    valid = valid && nodes[header->nodes].firstChild <= header->nodes;
+    for (uint32_t i = 0; valid && i < header->nodes; ++i) {
+        const AclNode &node = nodes[i], &next = nodes[i + 1];
+        valid = (uint64_t) node.label + node.length <= header->labelBytes && node.firstChild <= next.firstChild &&
+                (node.firstChild == next.firstChild || node.firstChild > i) &&
+                node.exact <= (uint8_t) aclAction::block && node.suffix <= (uint8_t) aclAction::block;
+    }
+    if (!valid) {
+        munmap(mapped, mappedSize);
+        throw runtime_error("Not an ACL file, unsupported version or damaged.");
+    }
+}
+
+Acl::~Acl() {
+    munmap(mapped, mappedSize);
+}
+
+aclAction Acl::match(const char *host, size_t length) const {
+    if (length != 0 && host[length - 1] == '.') {
+        --length;
+    }
+    auto best = (aclAction) nodes[0].suffix;
+    const AclNode *node = nodes;
+    size_t end = length;
+    while (end != 0) {
+        size_t start = end;
+        while (start != 0 && host[start - 1] != '.') {
+            --start;
+        }
+        //binary search among the children for the label host[start, end)
+        const AclNode *first = nodes + node->firstChild, *last = nodes + node[1].firstChild;
+        const AclNode *found = nullptr;
+        while (first < last) {
+            const AclNode *middle = first + (last - first) / 2;
+            int order = compareLabel(host + start, end - start, *middle, labels);
+            if (order == 0) {
+                found = middle;
+                break;
+            }
+            if (order < 0) {
+                last = middle;
+            } else {
+                first = middle + 1;
+            }
+        }
+        if (found == nullptr) {
+            break;
+        }
+        node = found;
+        if (node->suffix != (uint8_t) aclAction::none) {
+            best = (aclAction) node->suffix;
+        }
+        if (start == 0) {
+            if (node->exact != (uint8_t) aclAction::none) {
+                return (aclAction) node->exact;
+            }
+            break;
+        }
+        end = start - 1;
+    }
+    return best != aclAction::none ? best : (aclAction) header->defaultAction;
+}
+
+size_t Acl::compile(istream &rules, const string &path) {
+    vector<Rule> parsed;
+    auto defaultAction = aclAction::allow;
+    string line, word, pattern, extra;
+    for (size_t number = 1; getline(rules, line); ++number) {
+        line.erase(find(line.begin(), line.end(), '#'), line.end());
+        istringstream fields(line);
+        if (!(fields >> word)) {
+            continue;
+        }
+        aclAction action = word == "default" ? aclAction::none : parseAction(word);
+        if (!(fields >> pattern) || (fields >> extra)) {
+            throw runtime_error("Malformed ACL rule on line " + to_string(number) + ".");
+        }
+        if (word == "default") {
+            if ((defaultAction = parseAction(pattern)) == aclAction::none) {
+                throw runtime_error("Unknown default action on line " + to_string(number) + ".");
+            }
+            continue;
+        }
+        if (action == aclAction::none) {
+            throw runtime_error("Unknown ACL action on line " + to_string(number) + ".");
+        }
+
+        bool suffix = pattern[0] == '.';
+        size_t begin = suffix ? 1 : 0, end = pattern.size();
+        if (end > begin && pattern[end - 1] == '.') {
+            --end;
+        }
+        Rule rule{string(), suffix, action};
+        rule.key.reserve(end - begin + 1);
+        //labels from the last one on, none empty or longer than DNS allows
+        bool valid = end > begin;
+        while (valid) {
+            size_t dot = pattern.rfind('.', end - 1);
+            size_t start = dot == string::npos || dot < begin ? begin : dot + 1;
+            valid = start < end && end - start <= 63;
+            for (size_t i = start; i < end; ++i) {
+                rule.key += (char) lowerTable[(unsigned char) pattern[i]];
+            }
+            rule.key += '\0';
+            if (start == begin) {
+                break;
+            }
+            end = start - 1;
+            valid = valid && end > begin;
+        }
+        if (!valid) {
+            throw runtime_error("Malformed host name on line " + to_string(number) + ".");
+        }
+        parsed.push_back(move(rule));
+    }
+    stable_sort(parsed.begin(), parsed.end(), [](const Rule &left, const Rule &right) {
+        return left.key < right.key;
+    });
+
+    //breadth first, so that the children of a node are contiguous; a node covers the rules in
+    //[begin, end), which share their first depth labels, the prefix of offset bytes
+    struct Pending {
+        size_t begin, end, offset;
+    };
+    vector<AclNode> trie(1, AclNode());
+    vector<Pending> pending(1, Pending{0, parsed.size(), 0});
+    string pool;
+    unordered_map<string, uint32_t> pooled;
+    for (size_t index = 0; index < pending.size(); ++index) {
+        Pending current = pending[index];
+        trie[index].firstChild = (uint32_t) trie.size();
+        size_t i = current.begin;
+        //rules ending here sort first
+        for (; i < current.end && parsed[i].key.size() == current.offset; ++i) {
+            (parsed[i].suffix ? trie[index].suffix : trie[index].exact) = (uint8_t) parsed[i].action;
+        }
+        if (i == current.end) {
+            continue;
+        }
+        if (trie.size() + (current.end - i) >= UINT32_MAX) {
+            throw runtime_error("Too many ACL rules.");
+        }
+        while (i < current.end) {
+            const string &key = parsed[i].key;
+            size_t labelEnd = key.find('\0', current.offset);
+            string label = key.substr(current.offset, labelEnd - current.offset);
+            size_t next = i + 1;
+            while (next < current.end && parsed[next].key.compare(current.offset, labelEnd + 1 - current.offset, key,
+                                                                  current.offset, labelEnd + 1 - current.offset) == 0) {
+                ++next;
+            }
+            auto stored = pooled.find(label);
+            if (stored == pooled.end()) {
+                stored = pooled.emplace(label, (uint32_t) pool.size()).first;
+                pool += label;
+            }
+            AclNode node = AclNode();
+            node.label = stored->second;
+            node.length = (uint8_t) label.size();
+            label.copy(node.prefix, sizeof(node.prefix));
+            trie.push_back(node);
+            pending.push_back(Pending{i, next, labelEnd + 1});
+            i = next;
+        }
+    }
+    //closes the children of the last node
+    AclNode last = AclNode();
+    last.firstChild = (uint32_t) trie.size();
+
+    AclHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "PXAL", 4);
+    header.version = version;
+    header.nodes = (uint32_t) trie.size();
+    trie.push_back(last);
+    header.labelBytes = (uint32_t) pool.size();
+    header.defaultAction = (uint8_t) defaultAction;
+
+    //replaced in one step, a proxy may be mapping the previous file right now
+    string temporary = path + ".tmp";
+    {
+        ofstream file(temporary, ios::binary | ios::trunc);
+        file.write((const char *) &header, sizeof(header));
+        file.write((const char *) trie.data(), trie.size() * sizeof(AclNode));
+        file.write(pool.data(), pool.size());
+        if (!file.flush()) {
+            throw runtime_error("Unable to write the ACL file.");
+        }
+    }
+    if (rename(temporary.c_str(), path.c_str()) < 0) {
+        throw runtime_error("Unable to write the ACL file." + string(strerror(errno)));
+    }
+    return parsed.size();
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <string>
+
+/* Destination access list compiled by aclc into a read-only file that is mapped as it is.
+ * The file is an AclHeader, the nodes of a trie over the reversed labels of the host names, and a pool
+ * holding each distinct label once. The root is node 0; the children of a node are contiguous, sorted by
+ * label, and come after it, so they end where those of the next node begin, a last node closes the list.
+ * A lookup walks from the last label of the host to the first with a binary search per level and
+ * allocates nothing; the first bytes of each label are kept in its node, most steps never read the pool.
+ *
+ * Rules, one per line, "#" starts a comment:
+ *   allow|block example.com     the host itself
+ *   allow|block .example.com    the host and every name below it
+ *   default allow|block         for hosts no rule matches, allow if not given
+ * The most specific rule wins: an exact rule over a suffix rule for the same name, a longer suffix over a
+ * shorter one. Among equal rules the later line wins. */
+
+enum class aclAction : uint8_t {
+    none, allow, block
+};
+
+struct AclHeader {
+    char magic[4];
+    uint32_t version, nodes, labelBytes;
+    uint8_t defaultAction, pad[7];
+};
+
+struct AclNode {
+    //offset of the label in the pool, and the first child
+    uint32_t label, firstChild;
+    char prefix[4];
+    uint8_t length;
+    //aclAction for the name itself, and for it with everything below
+    uint8_t exact, suffix, pad;
+};
+
+static_assert(sizeof(AclHeader) == 24 && sizeof(AclNode) == 16, "ACL layouts are part of the file format");
+
+class Acl {
+    void *mapped;
+    size_t mappedSize;
+    const AclHeader *header;
+    const AclNode *nodes;
+    const char *labels;
+
+public:
+    static const uint32_t version = 1;
+
+    //maps and checks a compiled list, throws runtime_error if it is unreadable or malformed;
+    //every page is read in here, so that lookups never wait for the disk
+    explicit Acl(const std::string &path);
+    Acl(const Acl &) = delete;
+    ~Acl();
+
+    //case-insensitive, a trailing dot is ignored
+    aclAction match(const char *host, size_t length) const;
+
+    uint32_t size() const {
+        return header->nodes;
+    }
+
+    //writes the compiled form of the rules to path, returns the number of rules;
+    //throws runtime_error naming the line of a malformed rule
+    static size_t compile(std::istream &rules, const std::string &path);
+};
@@ -0,0 +1,59 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include "acl.h"
+
+using namespace std;
+
+static const char *actionNames[] = {"none", "allow", "block"};
+
+int main(int argc, char **argv) {
+    if (argc == 3 && argv[1][0] != '-') {
+        ifstream rules(argv[1]);
+        if (!rules) {
+            cerr << "Unable to read " << argv[1] << ".\n";
+            return 1;
+        }
+        try {
+            auto start = chrono::steady_clock::now();
+            size_t count = Acl::compile(rules, argv[2]);
+            Acl acl(argv[2]);
+            cout << count << " rules, " << acl.size() << " nodes in "
+                 << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s\n";
+        } catch (const exception &e) {
+            cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    //prints the action for every host, and the time a lookup takes on average
+    if (argc >= 4 && strcmp(argv[1], "--match") == 0) {
+        try {
+            Acl acl(argv[2]);
+            vector<const char *> hosts(argv + 3, argv + argc);
+            for (const char *host : hosts) {
+                cout << host << ' ' << actionNames[(unsigned) acl.match(host, strlen(host))] << '\n';
+            }
+            static const unsigned rounds = 1000000;
+            unsigned blocked = 0;
+            auto start = chrono::steady_clock::now();
+            for (unsigned i = 0; i < rounds; ++i) {
+                const char *host = hosts[i % hosts.size()];
+                blocked += acl.match(host, strlen(host)) == aclAction::block;
+            }
+            double nanoseconds = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+            cout << "# " << nanoseconds / rounds << " ns per lookup (" << blocked << " blocked)\n";
+        } catch (const exception &e) {
+            cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    cout << "Usage: [rules file] [output file]\n"
+            "       --match [compiled file] [host]...\n";
+    return 0;
+}
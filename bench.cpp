@@ -0,0 +1,232 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include "proxy.h"
+
+/* Loopback benchmark of the accept-to-close path.
+ * Clients open a CONNECT tunnel through the proxy to a local origin, send one request and read the
+ * response until the origin closes. The proxy runs on its own thread and every heap allocation made
+ * on that thread is counted, so steady-state allocations per connection can be read off directly.
+ * With parent proxies the tunnels are chained through that many more proxies, each on its own thread.
+ * A zero-copy threshold makes the front proxy send larger chunks to clients with MSG_ZEROCOPY; on
+ * loopback the kernel copies anyway and the proxy stops after the first completion, so compare large
+ * responses with and without it against clients on another host to see the gain on a real NIC. */
+
+static thread_local bool counted = false;
+static atomic<unsigned long> allocations{0};
+
+void *operator new(size_t size) {
+    if (counted) {
+        allocations.fetch_add(1, memory_order_relaxed);
+    }
+    if (void *ptr = malloc(size)) {
+        return ptr;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+static int listenLoopback(unsigned short &port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (fd < 0 || bind(fd, (sockaddr *) &address, sizeof(address)) < 0 || ::listen(fd, 1024) < 0 ||
+        getsockname(fd, (sockaddr *) &address, &length) < 0) {
+        throw runtime_error("Unable to listen on loopback.");
+    }
+    port = ntohs(address.sin_port);
+    return fd;
+}
+
+static unsigned short freePort() {
+    unsigned short port;
+    ::close(listenLoopback(port));
+    return port;
+}
+
+static int connectLoopback(unsigned short port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (fd < 0 || ::connect(fd, (sockaddr *) &address, sizeof(address)) < 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+//reads until the blank line that ends an HTTP head, returns false on EOF
+static bool readHead(int fd) {
+    char buffer[4096];
+    unsigned matched = 0;
+    static const char end[] = "\r\n\r\n";
+    while (matched < 4) {
+        if (recv(fd, buffer, 1, 0) != 1) {
+            return false;
+        }
+        matched = buffer[0] == end[matched] ? matched + 1 : (buffer[0] == '\r' ? 1 : 0);
+    }
+    return true;
+}
+
+static void sendAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        long sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return;
+        }
+        data += sent;
+        size -= sent;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc > 6) {
+        cout << "Usage: [connections] [concurrency] [response bytes] [parent proxies] [zero-copy threshold]\n";
+        return 0;
+    }
+    unsigned connections = argc > 1 ? stoul(argv[1]) : 20000;
+    unsigned concurrency = argc > 2 ? stoul(argv[2]) : 8;
+    unsigned responseSize = argc > 3 ? stoul(argv[3]) : 1024;
+    unsigned parentCount = argc > 4 ? stoul(argv[4]) : 0;
+    unsigned zeroCopyThreshold = argc > 5 ? stoul(argv[5]) : 0;
+
+    unsigned short originPort;
+    int originFd = listenLoopback(originPort);
+    string response = "HTTP/1.1 200 OK\r\nContent-Length: " + to_string(responseSize) + "\r\n\r\n" +
+                      string(responseSize, 'x');
+    for (unsigned i = 0; i < concurrency; ++i) {
+        thread([originFd, &response]() {
+            for (;;) {
+                int fd = ::accept(originFd, nullptr, nullptr);
+                if (fd < 0) {
+                    continue;
+                }
+                if (readHead(fd)) {
+                    sendAll(fd, response.data(), response.size());
+                }
+                ::close(fd);
+            }
+        }).detach();
+    }
+
+    vector<string> parents;
+    for (unsigned i = 0; i < parentCount; ++i) {
+        string parentHttp = to_string(freePort()), parentHttps = to_string(freePort());
+        parents.push_back(parentHttps);
+        thread([parentHttp, parentHttps]() {
+            Proxy proxy;
+            proxy.run(parentHttp, parentHttps);
+        }).detach();
+    }
+
+    string httpPort = to_string(freePort()), httpsPort = to_string(freePort());
+    thread([httpPort, httpsPort, parents, zeroCopyThreshold]() {
+        counted = true;
+        Proxy proxy;
+        TcpProfile profile = proxy.getProfile(ConnectionClass::clientTunnel);
+        profile.zeroCopyThreshold = zeroCopyThreshold;
+        proxy.setProfile(ConnectionClass::clientTunnel, profile);
+        for (auto &parent : parents) {
+            proxy.addParent("parents", "127.0.0.1", parent);
+        }
+        proxy.route("", "parents");
+        proxy.run(httpPort, httpsPort);
+    }).detach();
+
+    int probe;
+    while ((probe = connectLoopback(stoi(httpsPort))) < 0) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    ::close(probe);
+
+    string target = "127.0.0.1:" + to_string(originPort);
+    string request = "CONNECT " + target + " HTTP/1.1\r\nHost: " + target + "\r\n\r\n";
+    static const char get[] = "GET / HTTP/1.1\r\nHost: origin\r\n\r\n";
+
+    auto phase = [&](unsigned count, vector<double> &latencies, unsigned long &bytes) {
+        atomic<unsigned> next{0};
+        vector<vector<double>> perThread(concurrency);
+        vector<unsigned long> perThreadBytes(concurrency, 0);
+        vector<thread> clients;
+        for (unsigned i = 0; i < concurrency; ++i) {
+            clients.emplace_back([&, i]() {
+                char buffer[64 * 1024];
+                while (next.fetch_add(1) < count) {
+                    auto start = chrono::steady_clock::now();
+                    int fd = connectLoopback(stoi(httpsPort));
+                    if (fd < 0) {
+                        continue;
+                    }
+                    sendAll(fd, request.data(), request.size());
+                    if (readHead(fd)) {
+                        sendAll(fd, get, sizeof(get) - 1);
+                        long received;
+                        while ((received = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+                            perThreadBytes[i] += received;
+                        }
+                    }
+                    ::close(fd);
+                    perThread[i].push_back(
+                            chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+                }
+            });
+        }
+        for (auto &client : clients) {
+            client.join();
+        }
+        for (unsigned i = 0; i < concurrency; ++i) {
+            latencies.insert(latencies.end(), perThread[i].begin(), perThread[i].end());
+            bytes += perThreadBytes[i];
+        }
+    };
+
+    vector<double> latencies;
+    unsigned long bytes = 0;
+    phase(max(connections / 10, concurrency), latencies, bytes);
+    //give the proxy time to close the warm-up connections before counting
+    this_thread::sleep_for(chrono::milliseconds(200));
+
+    latencies.clear();
+    bytes = 0;
+    unsigned long before = allocations.load();
+    auto start = chrono::steady_clock::now();
+    phase(connections, latencies, bytes);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    this_thread::sleep_for(chrono::milliseconds(200));
+    unsigned long after = allocations.load();
+
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies.empty() ? 0.0 : latencies[min(latencies.size() - 1, (size_t) (p * latencies.size()))];
+    };
+    cout << "connections:         " << latencies.size() << " in " << seconds << " s ("
+         << latencies.size() / seconds << " conn/s)\n";
+    cout << "throughput:          " << bytes / seconds / (1024 * 1024) << " MiB/s\n";
+    cout << "latency p50/p99/max: " << percentile(0.5) << " / " << percentile(0.99) << " / "
+         << (latencies.empty() ? 0.0 : latencies.back()) << " us\n";
+    cout << "proxy allocations:   " << after - before << " ("
+         << (double) (after - before) / max<size_t>(latencies.size(), 1) << " per connection)\n";
+    //as the proxy saw them, warm-up included
+    Latency::report(cout);
+    cout.flush();
+    _exit(0);
+}
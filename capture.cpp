@@ -0,0 +1,30 @@
+#include "capture.h"
+#include "trace.h"
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+Capture::Capture(const string &path) {
+    if ((file = fopen(path.c_str(), "wb")) == nullptr) {
+        throw runtime_error("Unable to open capture file." + string(strerror(errno)));
+    }
+    setvbuf(file, nullptr, _IOFBF, 1 << 20);
+
+    CaptureHeader header;
+    memcpy(header.magic, "PXCP", 4);
+    header.version = version;
+    fwrite(&header, sizeof(header), 1, file);
+}
+
+Capture::~Capture() {
+    fclose(file);
+}
+
+void Capture::record(captureKind kind, uint32_t connection, const char *data, uint32_t length) {
+    CaptureRecord record{Trace::now(), connection, (uint8_t) kind, {0, 0, 0}, length, 0};
+    fwrite(&record, sizeof(record), 1, file);
+    if (length != 0) {
+        fwrite(data, 1, length, file);
+    }
+}
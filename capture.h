@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+/* Traffic capture for record-and-replay.
+ * A capture file is a CaptureHeader followed by CaptureRecords, each one followed by `length`
+ * payload bytes. Client and upstream connections share the client's connection id.
+ *   clientOpen    payload: default port of the listener ("80" or "443")
+ *   upstreamOpen  payload: "host:port" of the destination
+ *   *Data         bytes read by the proxy, *Sent bytes written by the proxy
+ *   *Close        payload: one traceReason byte
+ * Unlike Trace this writes synchronously on the event loop, it is meant for recording sessions. */
+
+enum class captureKind : uint8_t {
+    clientOpen, clientData, clientSent, clientClose, upstreamOpen, upstreamData, upstreamSent, upstreamClose
+};
+
+struct CaptureHeader {
+    char magic[4];
+    uint32_t version;
+};
+
+struct CaptureRecord {
+    uint64_t time;
+    uint32_t connection;
+    uint8_t kind, pad[3];
+    uint32_t length, pad2;
+};
+
+static_assert(sizeof(CaptureRecord) == 24, "capture records are part of the file format");
+
+class Capture {
+    FILE *file;
+
+public:
+    static const uint32_t version = 1;
+
+    //throws if the file cannot be created
+    explicit Capture(const std::string &path);
+    Capture(const Capture &) = delete;
+    ~Capture();
+
+    void record(captureKind kind, uint32_t connection, const char *data, uint32_t length);
+};
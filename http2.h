@@ -0,0 +1,457 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Enough HTTP/2 (RFC 7540) and HPACK (RFC 7541) for the client end of a cleartext connection opened with
+ * prior knowledge. The decoder handles everything a peer may send; the encoder only sends static table
+ * references and plain literals, so the peer's table size setting never matters. */
+
+enum class h2Frame : uint8_t {
+    data, headers, priority, rstStream, settings, pushPromise, ping, goAway, windowUpdate, continuation
+};
+
+enum class h2Error : uint32_t {
+    noError, protocol, internal, flowControl, settingsTimeout, streamClosed, frameSize, refusedStream, cancel,
+    compression, connect, enhanceYourCalm, inadequateSecurity, http11Required
+};
+
+enum class h2Setting : uint16_t {
+    headerTableSize = 1, enablePush, maxConcurrentStreams, initialWindowSize, maxFrameSize, maxHeaderListSize
+};
+
+typedef std::vector<std::pair<std::string, std::string>> H2Headers;
+
+struct H2FrameHeader {
+    static const unsigned size = 9;
+    static const uint8_t endStream = 0x1, ack = 0x1, endHeaders = 0x4, padded = 0x8, priority = 0x20;
+
+    uint32_t length, stream;
+    h2Frame type;
+    uint8_t flags;
+
+    static uint32_t read32(const char *data) {
+        const uint8_t *bytes = (const uint8_t *) data;
+        return (uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16 | (uint32_t) bytes[2] << 8 | bytes[3];
+    }
+
+    static H2FrameHeader parse(const char *data) {
+        const uint8_t *bytes = (const uint8_t *) data;
+        return H2FrameHeader{(uint32_t) bytes[0] << 16 | (uint32_t) bytes[1] << 8 | bytes[2],
+                             read32(data + 5) & 0x7fffffff, (h2Frame) bytes[3], bytes[4]};
+    }
+};
+
+//appends frames to the output of a connection
+struct H2Writer {
+    //what a client sends before its first SETTINGS
+    static void preface(std::string &out) {
+        static const char bytes[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+        out.append(bytes, sizeof(bytes) - 1);
+    }
+
+    static void put32(std::string &out, uint32_t value) {
+        char bytes[4] = {(char) (value >> 24), (char) (value >> 16), (char) (value >> 8), (char) value};
+        out.append(bytes, 4);
+    }
+
+    static void header(std::string &out, h2Frame type, uint8_t flags, uint32_t stream, uint32_t length) {
+        char bytes[5] = {(char) (length >> 16), (char) (length >> 8), (char) length, (char) type, (char) flags};
+        out.append(bytes, 5);
+        put32(out, stream);
+    }
+
+    static void frame(std::string &out, h2Frame type, uint8_t flags, uint32_t stream, const char *payload,
+                      uint32_t length) {
+        header(out, type, flags, stream, length);
+        out.append(payload, length);
+    }
+
+    static void settings(std::string &out, const std::vector<std::pair<h2Setting, uint32_t>> &values) {
+        header(out, h2Frame::settings, 0, 0, (uint32_t) values.size() * 6);
+        for (auto &value : values) {
+            char id[2] = {(char) ((uint16_t) value.first >> 8), (char) value.first};
+            out.append(id, 2);
+            put32(out, value.second);
+        }
+    }
+
+    static void settingsAck(std::string &out) {
+        header(out, h2Frame::settings, H2FrameHeader::ack, 0, 0);
+    }
+
+    static void windowUpdate(std::string &out, uint32_t stream, uint32_t increment) {
+        header(out, h2Frame::windowUpdate, 0, stream, 4);
+        put32(out, increment);
+    }
+
+    static void reset(std::string &out, uint32_t stream, h2Error error) {
+        header(out, h2Frame::rstStream, 0, stream, 4);
+        put32(out, (uint32_t) error);
+    }
+
+    static void goAway(std::string &out, uint32_t lastStream, h2Error error) {
+        header(out, h2Frame::goAway, 0, 0, 8);
+        put32(out, lastStream);
+        put32(out, (uint32_t) error);
+    }
+
+    //header block split into HEADERS and CONTINUATION frames of at most maxFrame bytes
+    static void headers(std::string &out, uint32_t stream, const std::string &block, bool endStream,
+                        uint32_t maxFrame) {
+        size_t offset = 0;
+        do {
+            uint32_t length = (uint32_t) std::min<size_t>(block.size() - offset, maxFrame);
+            uint8_t flags = offset + length == block.size() ? H2FrameHeader::endHeaders : 0;
+            if (offset == 0) {
+                frame(out, h2Frame::headers, flags | (endStream ? H2FrameHeader::endStream : 0), stream,
+                      block.data(), length);
+            } else {
+                frame(out, h2Frame::continuation, flags, stream, block.data() + offset, length);
+            }
+            offset += length;
+        } while (offset < block.size());
+    }
+};
+
+//RFC 7541 appendix A and B
+static const char *const hpackStaticTable[61][2] = {
+        {":authority", ""},
+        {":method", "GET"},
+        {":method", "POST"},
+        {":path", "/"},
+        {":path", "/index.html"},
+        {":scheme", "http"},
+        {":scheme", "https"},
+        {":status", "200"},
+        {":status", "204"},
+        {":status", "206"},
+        {":status", "304"},
+        {":status", "400"},
+        {":status", "404"},
+        {":status", "500"},
+        {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"},
+        {"accept-language", ""},
+        {"accept-ranges", ""},
+        {"accept", ""},
+        {"access-control-allow-origin", ""},
+        {"age", ""},
+        {"allow", ""},
+        {"authorization", ""},
+        {"cache-control", ""},
+        {"content-disposition", ""},
+        {"content-encoding", ""},
+        {"content-language", ""},
+        {"content-length", ""},
+        {"content-location", ""},
+        {"content-range", ""},
+        {"content-type", ""},
+        {"cookie", ""},
+        {"date", ""},
+        {"etag", ""},
+        {"expect", ""},
+        {"expires", ""},
+        {"from", ""},
+        {"host", ""},
+        {"if-match", ""},
+        {"if-modified-since", ""},
+        {"if-none-match", ""},
+        {"if-range", ""},
+        {"if-unmodified-since", ""},
+        {"last-modified", ""},
+        {"link", ""},
+        {"location", ""},
+        {"max-forwards", ""},
+        {"proxy-authenticate", ""},
+        {"proxy-authorization", ""},
+        {"range", ""},
+        {"referer", ""},
+        {"refresh", ""},
+        {"retry-after", ""},
+        {"server", ""},
+        {"set-cookie", ""},
+        {"strict-transport-security", ""},
+        {"transfer-encoding", ""},
+        {"user-agent", ""},
+        {"vary", ""},
+        {"via", ""},
+        {"www-authenticate", ""},
+};
+
+static const uint32_t huffmanCodes[256] = {
+        0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+        0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+        0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+        0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+        0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+        0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+        0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+        0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+        0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+        0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+        0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+        0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+        0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+        0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+        0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+        0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+        0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+        0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+        0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+        0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+        0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+        0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+        0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+        0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+        0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+        0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+        0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+        0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+        0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+        0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+        0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+        0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+static const uint8_t huffmanLengths[256] = {
+        13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+        28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+        6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+        5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+        13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+        15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+        6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+        20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+        24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+        22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+        21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+        26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+        19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+        20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+        26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+
+class HpackEncoder {
+    static void integer(std::string &out, uint32_t value, unsigned prefix, uint8_t pattern) {
+        uint32_t mask = (1u << prefix) - 1;
+        if (value < mask) {
+            out += (char) (pattern | value);
+            return;
+        }
+        out += (char) (pattern | mask);
+        for (value -= mask; value >= 0x80; value >>= 7) {
+            out += (char) (0x80 | (value & 0x7f));
+        }
+        out += (char) value;
+    }
+
+    static void string(std::string &out, const char *data, size_t length) {
+        integer(out, (uint32_t) length, 7, 0);
+        out.append(data, length);
+    }
+
+public:
+    //the name must be lower case
+    static void encode(std::string &out, const char *name, size_t nameLength, const char *value, size_t valueLength) {
+        unsigned nameIndex = 0;
+        for (unsigned i = 0; i < 61; ++i) {
+            if (strlen(hpackStaticTable[i][0]) != nameLength || memcmp(hpackStaticTable[i][0], name, nameLength) != 0) {
+                continue;
+            }
+            if (strlen(hpackStaticTable[i][1]) == valueLength && memcmp(hpackStaticTable[i][1], value, valueLength) == 0) {
+                integer(out, i + 1, 7, 0x80);
+                return;
+            }
+            if (nameIndex == 0) {
+                nameIndex = i + 1;
+            }
+        }
+        //literal without indexing
+        integer(out, nameIndex, 4, 0);
+        if (nameIndex == 0) {
+            string(out, name, nameLength);
+        }
+        string(out, value, valueLength);
+    }
+
+    static void encode(std::string &out, const std::string &name, const std::string &value) {
+        encode(out, name.data(), name.size(), value.data(), value.size());
+    }
+};
+
+//keeps the dynamic table of one connection; after a throw the table is out of step with the peer's
+class HpackDecoder {
+    //newest first
+    std::deque<std::pair<std::string, std::string>> table;
+    size_t tableSize = 0, maxTableSize = TABLE_SIZE;
+
+    //the tree has a leaf per symbol and 256 inner nodes; a child is an inner node index or -(symbol + 1),
+    //0 where no code leads
+    static std::vector<std::array<int16_t, 2>> buildHuffmanTree() {
+        std::vector<std::array<int16_t, 2>> tree;
+        tree.push_back({{0, 0}});
+        for (unsigned symbol = 0; symbol <= 256; ++symbol) {
+            uint32_t code = symbol == 256 ? 0x3fffffff : huffmanCodes[symbol];
+            unsigned length = symbol == 256 ? 30 : huffmanLengths[symbol];
+            unsigned node = 0;
+            for (unsigned bit = length; bit-- > 1;) {
+                unsigned value = (code >> bit) & 1;
+                if (tree[node][value] == 0) {
+                    tree[node][value] = (int16_t) tree.size();
+                    tree.push_back({{0, 0}});
+                }
+                node = (unsigned) tree[node][value];
+            }
+            tree[node][code & 1] = (int16_t) -(symbol + 1);
+        }
+        return tree;
+    }
+
+    //built once on first use, the workers may get there at the same time
+    static const std::vector<std::array<int16_t, 2>> &huffmanTree() {
+        static const auto tree = buildHuffmanTree();
+        return tree;
+    }
+
+    static uint64_t integer(const uint8_t *&pos, const uint8_t *end, unsigned prefix) {
+        uint64_t mask = (1u << prefix) - 1, value = *pos++ & mask;
+        if (value < mask) {
+            return value;
+        }
+        for (unsigned shift = 0;; shift += 7) {
+            if (pos == end || shift > 28) {
+                throw std::runtime_error("Malformed HPACK integer.");
+            }
+            uint8_t byte = *pos++;
+            value += (uint64_t) (byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+    }
+
+    static std::string string(const uint8_t *&pos, const uint8_t *end) {
+        if (pos == end) {
+            throw std::runtime_error("Malformed HPACK string.");
+        }
+        bool huffman = (*pos & 0x80) != 0;
+        uint64_t length = integer(pos, end, 7);
+        if (length > (uint64_t) (end - pos)) {
+            throw std::runtime_error("Malformed HPACK string.");
+        }
+        const uint8_t *data = pos;
+        pos += length;
+        if (!huffman) {
+            return std::string((const char *) data, length);
+        }
+
+        auto &tree = huffmanTree();
+        std::string result;
+        unsigned node = 0, bits = 0;
+        bool ones = true;
+        for (const uint8_t *byte = data; byte != pos; ++byte) {
+            for (unsigned bit = 8; bit-- > 0;) {
+                unsigned value = (*byte >> bit) & 1;
+                int16_t child = tree[node][value];
+                ones = ones && value == 1;
+                ++bits;
+                if (child == 0 || child == -257) {
+                    throw std::runtime_error("Malformed HPACK Huffman string.");
+                }
+                if (child < 0) {
+                    result += (char) (-child - 1);
+                    node = 0;
+                    bits = 0;
+                    ones = true;
+                } else {
+                    node = (unsigned) child;
+                }
+            }
+        }
+        //padding is a prefix of EOS shorter than a byte
+        if (bits > 7 || !ones) {
+            throw std::runtime_error("Malformed HPACK Huffman padding.");
+        }
+        return result;
+    }
+
+    const std::pair<std::string, std::string> &entry(uint64_t index, std::pair<std::string, std::string> &scratch) {
+        if (index == 0 || index > 61 + table.size()) {
+            throw std::runtime_error("HPACK index out of range.");
+        }
+        if (index <= 61) {
+            scratch.first = hpackStaticTable[index - 1][0];
+            scratch.second = hpackStaticTable[index - 1][1];
+            return scratch;
+        }
+        return table[index - 62];
+    }
+
+    void fit(size_t size) {
+        while (!table.empty() && tableSize + size > maxTableSize) {
+            tableSize -= table.back().first.size() + table.back().second.size() + 32;
+            table.pop_back();
+        }
+    }
+
+    void insert(const std::pair<std::string, std::string> &field) {
+        size_t size = field.first.size() + field.second.size() + 32;
+        fit(size);
+        if (size <= maxTableSize) {
+            table.push_front(field);
+            tableSize += size;
+        }
+    }
+
+public:
+    //the SETTINGS_HEADER_TABLE_SIZE default, which is what the proxy advertises
+    static const size_t TABLE_SIZE = 4096;
+    //decoded bytes per block, an indexed field costs a byte but may expand to a whole table entry
+    static const size_t MAX_LIST_SIZE = 64 * 1024;
+
+    //appends to headers; throws runtime_error on a malformed block, a connection error
+    void decode(const char *data, size_t size, H2Headers &headers) {
+        const uint8_t *pos = (const uint8_t *) data, *end = pos + size;
+        std::pair<std::string, std::string> scratch;
+        size_t listSize = 0;
+        while (pos != end) {
+            uint8_t first = *pos;
+            if ((first & 0xe0) == 0x20) {
+                uint64_t max = integer(pos, end, 5);
+                if (max > TABLE_SIZE) {
+                    throw std::runtime_error("HPACK table size above the limit.");
+                }
+                maxTableSize = max;
+                fit(0);
+                continue;
+            }
+            if ((first & 0x80) != 0) {
+                headers.push_back(entry(integer(pos, end, 7), scratch));
+            } else {
+                //with incremental indexing, or without indexing and never indexed
+                bool indexing = (first & 0x40) != 0;
+                uint64_t index = integer(pos, end, indexing ? 6 : 4);
+                std::pair<std::string, std::string> field;
+                field.first = index != 0 ? entry(index, scratch).first : string(pos, end);
+                field.second = string(pos, end);
+                if (indexing) {
+                    insert(field);
+                }
+                headers.push_back(std::move(field));
+            }
+            listSize += headers.back().first.size() + headers.back().second.size() + 32;
+            if (listSize > MAX_LIST_SIZE) {
+                throw std::runtime_error("HPACK header list too large.");
+            }
+        }
+    }
+};
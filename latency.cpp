@@ -0,0 +1,187 @@
+#include "latency.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+//four buckets per power of two of microseconds, exact below 4, up to about twelve days
+const unsigned BUCKETS = 160;
+
+//histogram 0 is the whole request, the others the time from the previous phase reached to that phase
+const char *phaseNames[Timeline::phases] = {"total", "request_byte", "parsed", "resolved", "connected",
+                                            "first_byte", "last_byte", "close"};
+
+const char *reasonNames[] = {"none", "done", "closed", "error", "connect_failed", "shed", "denied"};
+
+//written by one thread only, the relaxed atomics let report read it from another
+struct Histograms {
+    atomic<uint64_t> counts[Timeline::phases][BUCKETS];
+    atomic<uint64_t> maximum[Timeline::phases];
+    Histograms *next;
+
+    void add(unsigned phase, uint64_t micros) {
+        auto &count = counts[phase][bucketOf(micros)];
+        count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        if (micros > maximum[phase].load(memory_order_relaxed)) {
+            maximum[phase].store(micros, memory_order_relaxed);
+        }
+    }
+
+    static unsigned bucketOf(uint64_t micros) {
+        if (micros < 4) {
+            return (unsigned) micros;
+        }
+        unsigned log = 63 - __builtin_clzll(micros);
+        return min(BUCKETS - 1, (log - 1) * 4 + (unsigned) ((micros >> (log - 2)) & 3));
+    }
+
+    //the first value past the bucket
+    static uint64_t limitOf(unsigned bucket) {
+        if (bucket < 3) {
+            return bucket + 1;
+        }
+        ++bucket;
+        return (uint64_t) (4 + bucket % 4) << (bucket / 4 - 1);
+    }
+};
+
+struct Sample {
+    uint32_t connection;
+    traceReason reason;
+    Timeline timeline;
+};
+
+//never freed, the proxy is a global whose nodes record while the statics of other files are destroyed
+atomic<Histograms *> histograms{nullptr};
+thread_local Histograms *localHistograms = nullptr;
+
+atomic<uint64_t> slowThreshold{0};
+mutex samplesMutex;
+const unsigned SAMPLES = 64;
+Sample samples[SAMPLES];
+uint64_t sampled = 0;
+
+//the phases as offsets from the start in units of 2^shift nanoseconds, 0xffff for phases not reached
+void trace(uint32_t connection, const Timeline &timeline, traceReason reason) {
+    uint64_t start = timeline.at[0], last = 0;
+    for (uint64_t at : timeline.at) {
+        last = max(last, at);
+    }
+    uint8_t shift = 0;
+    while (((last - start) >> shift) > 0xfffe) {
+        ++shift;
+    }
+    uint16_t phases[Timeline::phases];
+    for (unsigned i = 0; i < Timeline::phases; ++i) {
+        phases[i] = timeline.at[i] == 0 ? 0xffff : (uint16_t) ((timeline.at[i] - start) >> shift);
+    }
+    TraceRecord record{start, connection, (uint8_t) traceEvent::request, (uint8_t) reason,
+                       (uint8_t) traceSide::client, shift, 0, 0};
+    static_assert(sizeof(phases) == sizeof(record.bytesIn) + sizeof(record.bytesOut), "phases fill the byte counts");
+    memcpy(&record.bytesIn, phases, sizeof(phases));
+    Trace::push(record);
+}
+
+}
+
+void Latency::setSlowThreshold(uint64_t nanoseconds) {
+    slowThreshold.store(nanoseconds, memory_order_relaxed);
+}
+
+void Latency::record(uint32_t connection, const Timeline &timeline, traceReason reason, bool tunnel) {
+    Histograms *local = localHistograms;
+    if (local == nullptr) {
+        local = localHistograms = new Histograms();
+        local->next = histograms.load();
+        while (!histograms.compare_exchange_weak(local->next, local)) {
+        }
+    }
+
+    //a tunnel ends whenever its client leaves, only its setup says something about the proxy
+    unsigned end = tunnel ? (unsigned) latencyPhase::responseByte + 1 : Timeline::phases;
+    uint64_t previous = timeline.at[0], last = 0;
+    for (unsigned phase = 1; phase < end; ++phase) {
+        uint64_t at = timeline.at[phase];
+        if (at != 0 && previous != 0 && at >= previous) {
+            local->add(phase, (at - previous) / 1000);
+            previous = at;
+        }
+    }
+
+    uint64_t started = timeline.at[(unsigned) latencyPhase::requestByte];
+    if (!tunnel && started != 0) {
+        //a request that never got to its last byte counts until the latest phase it reached
+        last = timeline.at[(unsigned) latencyPhase::lastByte];
+        if (last == 0) {
+            last = *max_element(timeline.at, timeline.at + Timeline::phases);
+        }
+        uint64_t total = last - started, threshold = slowThreshold.load(memory_order_relaxed);
+        local->add(0, total / 1000);
+        if (threshold != 0 && total >= threshold) {
+            lock_guard<mutex> lock(samplesMutex);
+            samples[sampled++ % SAMPLES] = Sample{connection, reason, timeline};
+        }
+    }
+
+    if (Trace::enabled()) {
+        trace(connection, timeline, reason);
+    }
+}
+
+void Latency::report(ostream &out) {
+    vector<uint64_t> counts(BUCKETS);
+    out << "# phase        requests     p50 us     p90 us     p99 us     max us\n";
+    for (unsigned phase = 0; phase < Timeline::phases; ++phase) {
+        fill(counts.begin(), counts.end(), 0);
+        uint64_t total = 0, maximum = 0;
+        for (Histograms *local = histograms.load(); local != nullptr; local = local->next) {
+            for (unsigned bucket = 0; bucket < BUCKETS; ++bucket) {
+                counts[bucket] += local->counts[phase][bucket].load(memory_order_relaxed);
+            }
+            maximum = max(maximum, local->maximum[phase].load(memory_order_relaxed));
+        }
+        for (uint64_t count : counts) {
+            total += count;
+        }
+        out.width(13);
+        out << left << phaseNames[phase] << right;
+        out.width(10);
+        out << total;
+        for (double share : {0.5, 0.9, 0.99}) {
+            uint64_t seen = 0, rank = (uint64_t) (share * total);
+            unsigned bucket = 0;
+            while (bucket < BUCKETS - 1 && (seen += counts[bucket]) <= rank) {
+                ++bucket;
+            }
+            out.width(11);
+            out << (total == 0 ? 0 : min(Histograms::limitOf(bucket), maximum));
+        }
+        out.width(11);
+        out << maximum << '\n';
+    }
+
+    lock_guard<mutex> lock(samplesMutex);
+    uint64_t kept = min<uint64_t>(sampled, SAMPLES);
+    out << "# " << sampled << " slow requests over " << slowThreshold.load(memory_order_relaxed) / 1000
+        << " us, the latest " << kept << ", microseconds after accept\n";
+    for (uint64_t i = sampled - kept; i < sampled; ++i) {
+        const Sample &sample = samples[i % SAMPLES];
+        unsigned reason = (unsigned) sample.reason;
+        out << sample.connection << ' ' << (reason < sizeof(reasonNames) / sizeof(*reasonNames) ? reasonNames[reason]
+                                                                                             : "unknown");
+        for (unsigned phase = 1; phase < Timeline::phases; ++phase) {
+            out << ' ' << phaseNames[phase] << '=';
+            if (sample.timeline.at[phase] == 0) {
+                out << '-';
+            } else {
+                out << (sample.timeline.at[phase] - sample.timeline.at[0]) / 1000;
+            }
+        }
+        out << '\n';
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include "trace.h"
+
+/* Per-request latency breakdown.
+ * Both nodes of a pair stamp the phases they see with one clock read each, the client node holds the
+ * request side and its upstream node the origin side. A finished request is folded into per-phase
+ * histograms, kept as a sample when it took longer than the slow threshold, and written to the trace as
+ * a traceEvent::request record when tracing is on. On a kept-alive connection the next request starts
+ * where the previous response ended. */
+
+enum class latencyPhase : uint8_t {
+    accept, requestByte, parsed, resolved, connected, responseByte, lastByte, close
+};
+
+//monotonic nanoseconds, 0 for phases the request did not reach; a reused upstream connection has no
+//resolved and connected phase, and only a request still in flight when its client left has a close
+struct Timeline {
+    static const unsigned phases = 8;
+
+    uint64_t at[phases] = {};
+
+    uint64_t mark(latencyPhase phase) {
+        return at[(unsigned) phase] = Trace::now();
+    }
+
+    bool reached(latencyPhase phase) const {
+        return at[(unsigned) phase] != 0;
+    }
+};
+
+class Latency {
+public:
+    //the time from the first request byte to the last response byte that makes a request slow,
+    //0 turns sampling off; tunnels are never sampled
+    static void setSlowThreshold(uint64_t nanoseconds);
+
+    //called from the thread that owns the nodes, allocates only for the first request of a thread
+    static void record(uint32_t connection, const Timeline &timeline, traceReason reason, bool tunnel);
+
+    //phase percentiles in microseconds over everything recorded so far, then the latest slow samples;
+    //may run on any thread
+    static void report(std::ostream &out);
+};
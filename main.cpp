@@ -1,17 +1,351 @@
 #include <signal.h>
+#include <thread>
+#include <boost/program_options.hpp>
 #include "proxy.h"
 
-   Proxy proxy;
+namespace po = boost::program_options;
+
+/* Everything main can be told, from the command line and the file given with --config; the command line
+ * wins. Settings under "runtime" are applied again on SIGHUP to the running workers, on their own threads
+ * and without touching a connection; the others only take effect on a restart. */
+struct Settings {
+    string config;
+
+    //restart only
+    string httpPort, httpsPort, socksPort;
+    unsigned workers = 1, bufferSize = 10 * 1024 * 1024, bufferPool = 10;
+    int backlog = 10;
+    string trace, capture, warmStart;
+    unsigned warmConnections = 0;
+    vector<string> parents, balance, routes, http2;
+
+    //runtime
+    string acl;
+    unsigned slowMillis = 0;
+    unsigned ioBytes = 256 * 1024, ioSyscalls = 16;
+    unsigned long bulk = 1024 * 1024;
+    unsigned zeroCopy = 0;
+    bool adaptive = false;
+    LoadThresholds load;
+    ProxyLimits limits;
+    vector<string> shapeClients, shapeDestinations;
+    vector<string> socksUsers;
+
+    bool sameStartup(const Settings &other) const {
+        return tie(httpPort, httpsPort, socksPort, workers, bufferSize, bufferPool, backlog, trace, capture,
+                   warmStart, warmConnections, parents, balance, routes, http2) ==
+               tie(other.httpPort, other.httpsPort, other.socksPort, other.workers, other.bufferSize,
+                   other.bufferPool, other.backlog, other.trace, other.capture, other.warmStart,
+                   other.warmConnections, other.parents, other.balance, other.routes, other.http2);
+    }
+};
+
+//declared first so that it outlives the nodes of the proxies, they record their close into it
+unique_ptr<Capture> capture;
+vector<unique_ptr<Proxy>> proxies;
 
 void my_handler(int sig,siginfo_t *siginfo,void *context) {
-    exit(0);
+    for (auto &proxy : proxies) {
+        proxy->stop();
+    }
+}
+
+//"name=value", the value may hold further separators
+static pair<string, string> splitSetting(const string &setting, char separator) {
+    size_t at = setting.find(separator);
+    if (at == string::npos) {
+        throw runtime_error("Expected " + string(1, separator) + " in " + setting + ".");
+    }
+    return make_pair(setting.substr(0, at), setting.substr(at + 1));
+}
+
+static pair<string, string> splitAddress(const string &address) {
+    size_t colon = address.rfind(':');
+    if (colon == string::npos || colon == 0 || colon + 1 == address.size()) {
+        throw runtime_error("Expected host:port, got " + address + ".");
+    }
+    return make_pair(address.substr(0, colon), address.substr(colon + 1));
+}
+
+//"key=bytes per second[,burst]", the burst defaults to one second of traffic
+static void shape(const string &rule, const function<void(const string &, double, double)> &apply) {
+    auto setting = splitSetting(rule, '=');
+    size_t comma = setting.second.find(',');
+    double rate = 0, burst = 0;
+    try {
+        rate = stod(setting.second.substr(0, comma));
+        burst = comma == string::npos ? rate : stod(setting.second.substr(comma + 1));
+    } catch (const logic_error &) {
+    }
+    if (rate <= 0 || burst <= 0) {
+        throw runtime_error("Shaping needs a positive rate and burst: " + rule + ".");
+    }
+    apply(setting.first, rate, burst);
+}
+
+//"user:password", RFC 1929 allows 1 to 255 bytes for each
+static pair<string, string> login(const string &setting) {
+    auto credentials = splitSetting(setting, ':');
+    if (credentials.first.empty() || credentials.first.size() > 255 || credentials.second.empty() ||
+        credentials.second.size() > 255) {
+        throw runtime_error("SOCKS5 users and passwords have 1 to 255 bytes.");
+    }
+    return credentials;
+}
+
+//false if only the usage was asked for; throws on anything malformed
+static bool parse(int argc, char **argv, Settings &settings) {
+    po::options_description options("Options");
+    options.add_options()
+            ("help", "print this and exit")
+            ("config", po::value(&settings.config), "INI file with any of the options below, name = value")
+            ("http-port", po::value(&settings.httpPort)->required(), "plain HTTP listener")
+            ("https-port", po::value(&settings.httpsPort)->required(), "listener for CONNECT, port 443 by default")
+            ("socks-port", po::value(&settings.socksPort), "SOCKS5 listener, CONNECT only")
+            ("workers", po::value(&settings.workers)->default_value(settings.workers),
+             "event loops, each on a thread of its own behind the same ports")
+            ("buffer-size", po::value(&settings.bufferSize)->default_value(settings.bufferSize),
+             "bytes buffered per connection")
+            ("buffer-pool", po::value(&settings.bufferPool)->default_value(settings.bufferPool),
+             "buffers allocated up front per worker")
+            ("backlog", po::value(&settings.backlog)->default_value(settings.backlog), "listen backlog")
+            ("trace", po::value(&settings.trace), "binary trace file")
+            ("capture", po::value(&settings.capture), "capture file for replay, needs a single worker")
+            ("warm-start", po::value(&settings.warmStart), "origins to connect to at start, rewritten at exit")
+            ("warm-connections", po::value(&settings.warmConnections)->default_value(settings.warmConnections),
+             "idle connections per warm origin and worker")
+            ("parent", po::value(&settings.parents)->composing(), "group=host:port, a parent proxy")
+            ("balance", po::value(&settings.balance)->composing(), "group=latency|least-outstanding")
+            ("route", po::value(&settings.routes)->composing(), "host=group, an empty host routes every other")
+            ("http2", po::value(&settings.http2)->composing(), "host:port reached over cleartext HTTP/2")
+            ("acl", po::value(&settings.acl), "compiled ACL file, also loaded again on SIGUSR1")
+            ("slow-request-ms", po::value(&settings.slowMillis)->default_value(settings.slowMillis),
+             "requests kept as slow samples, 0 for none")
+            ("io-bytes", po::value(&settings.ioBytes)->default_value(settings.ioBytes),
+             "bytes one socket may move per turn of the loop")
+            ("io-syscalls", po::value(&settings.ioSyscalls)->default_value(settings.ioSyscalls),
+             "reads and writes one socket may make per turn of the loop")
+            ("bulk-bytes", po::value(&settings.bulk)->default_value(settings.bulk),
+             "bytes after which a connection counts as bulk")
+            ("zero-copy-bytes", po::value(&settings.zeroCopy)->default_value(settings.zeroCopy),
+             "tunnel and upstream writes that go out with MSG_ZEROCOPY on connections opened afterwards, 0 for none")
+            ("adaptive-buffers", po::value(&settings.adaptive)->default_value(settings.adaptive),
+             "size the send buffers of tunnel and upstream connections opened afterwards from their throughput")
+            ("overload-iteration-us", po::value(&settings.load.iterationMicros)
+                    ->default_value(settings.load.iterationMicros), "loop iteration that counts as overload")
+            ("overload-backlog", po::value(&settings.load.backlogEvents)
+                    ->default_value(settings.load.backlogEvents), "events per iteration that count as overload")
+            ("overload-lag-us", po::value(&settings.load.lagMicros)->default_value(settings.load.lagMicros),
+             "time a ready event waits in the pass before its slot runs that counts as overload")
+            ("overload-leave-ratio", po::value(&settings.load.leaveRatio)->default_value(settings.load.leaveRatio),
+             "share of every limit to fall below to leave overload")
+            ("overload-hold-ms", po::value(&settings.load.holdMillis)->default_value(settings.load.holdMillis),
+             "time to stay overloaded at least")
+            ("defer-interval-ms", po::value(&settings.limits.deferInterval)
+                    ->default_value(settings.limits.deferInterval), "retry interval of deferred CONNECTs")
+            ("max-deferral-ms", po::value(&settings.limits.maxDeferral)->default_value(settings.limits.maxDeferral),
+             "time before a deferred CONNECT gets 503")
+            ("resume-batch", po::value(&settings.limits.resumeBatch)->default_value(settings.limits.resumeBatch),
+             "deferred CONNECTs resumed per retry")
+            ("max-idle", po::value(&settings.limits.maxIdle)->default_value(settings.limits.maxIdle),
+             "idle keep-alive connections per parent")
+            ("resolve-cache", po::value(&settings.limits.resolveCache)->default_value(settings.limits.resolveCache),
+             "resolved hosts kept")
+            ("resolve-seconds", po::value(&settings.limits.resolveSeconds)
+                    ->default_value(settings.limits.resolveSeconds), "how long a resolved address is used")
+            ("shape-client", po::value(&settings.shapeClients)->composing(),
+             "address=bytes per second[,burst], an empty address gives every other one a limit of its own")
+            ("shape-destination", po::value(&settings.shapeDestinations)->composing(),
+             "host=bytes per second[,burst], the same for destinations")
+            ("socks-user", po::value(&settings.socksUsers)->composing(),
+             "user:password, SOCKS5 clients have to log in as one of these when any is given");
+
+    //the arguments main used to take, in their order
+    po::positional_options_description positional;
+    positional.add("http-port", 1).add("https-port", 1).add("trace", 1).add("capture", 1).add("warm-start", 1)
+            .add("warm-connections", 1).add("acl", 1).add("slow-request-ms", 1);
+
+    po::variables_map values;
+    po::store(po::command_line_parser(argc, argv).options(options).positional(positional).run(), values);
+    if (values.count("help")) {
+        cout << "Usage: [HTTP port] [HTTPS port] [trace file or -] [capture file or -] [warm start file or -] "
+                "[connections per warm origin] [compiled ACL file or -] [slow request milliseconds] [options]\n"
+             << options;
+        return false;
+    }
+    if (values.count("config")) {
+        po::store(po::parse_config_file<char>(values["config"].as<string>().c_str(), options), values);
+    }
+    po::notify(values);
+
+    for (string *file : {&settings.trace, &settings.capture, &settings.warmStart, &settings.acl}) {
+        if (*file == "-") {
+            file->clear();
+        }
+    }
+    if (settings.workers == 0 || settings.bufferSize < 16 * 1024 || settings.bufferPool == 0 || settings.backlog <= 0) {
+        throw runtime_error("Needs a worker, buffers of 16 KiB at least, a pool and a backlog.");
+    }
+    if (settings.workers > 1 && !settings.capture.empty()) {
+        throw runtime_error("A capture needs a single worker.");
+    }
+    //checked here, a bad rule must not leave the workers half applied on a reload
+    for (auto &rule : settings.shapeClients) {
+        shape(rule, [](const string &, double, double) {});
+    }
+    for (auto &rule : settings.shapeDestinations) {
+        shape(rule, [](const string &, double, double) {});
+    }
+    for (auto &user : settings.socksUsers) {
+        login(user);
+    }
+    return true;
+}
+
+//on the thread of the proxy
+static void applyRuntime(Proxy &proxy, const Settings &settings) {
+    proxy.setLimits(settings.limits);
+    proxy.setLoadThresholds(settings.load);
+    proxy.setIoBudget(settings.ioBytes, settings.ioSyscalls);
+    proxy.setBulkThreshold(settings.bulk);
+    for (auto connectionClass : {ConnectionClass::clientTunnel, ConnectionClass::upstream}) {
+        TcpProfile profile = proxy.getProfile(connectionClass);
+        profile.zeroCopyThreshold = settings.zeroCopy;
+        profile.adaptive = settings.adaptive;
+        proxy.setProfile(connectionClass, profile);
+    }
+    proxy.clearShaping();
+    for (auto &rule : settings.shapeClients) {
+        shape(rule, [&proxy](const string &key, double rate, double burst) {
+            proxy.shapeClient(key, rate, burst);
+        });
+    }
+    for (auto &rule : settings.shapeDestinations) {
+        shape(rule, [&proxy](const string &key, double rate, double burst) {
+            proxy.shapeDestination(key, rate, burst);
+        });
+    }
+    proxy.clearSocksUsers();
+    for (auto &user : settings.socksUsers) {
+        auto credentials = login(user);
+        proxy.addSocksUser(credentials.first, credentials.second);
+    }
+}
+
+static void applyStartup(Proxy &proxy, const Settings &settings) {
+    for (auto &setting : settings.parents) {
+        auto parent = splitSetting(setting, '=');
+        auto address = splitAddress(parent.second);
+        proxy.addParent(parent.first, address.first, address.second);
+    }
+    for (auto &setting : settings.balance) {
+        auto balance = splitSetting(setting, '=');
+        if (balance.second != "latency" && balance.second != "least-outstanding") {
+            throw runtime_error("Unknown balance " + balance.second + ".");
+        }
+        proxy.setBalance(balance.first, balance.second == "latency" ? Balance::latency : Balance::leastOutstanding);
+    }
+    for (auto &setting : settings.routes) {
+        auto route = splitSetting(setting, '=');
+        proxy.route(route.first, route.second);
+    }
+    for (auto &setting : settings.http2) {
+        auto address = splitAddress(setting);
+        proxy.useHttp2(address.first, address.second);
+    }
+    proxy.setListenOptions(settings.backlog, settings.workers > 1);
+    applyRuntime(proxy, settings);
+}
+
+static void loadAcl(const Settings &settings) {
+    shared_ptr<const Acl> acl;
+    if (!settings.acl.empty()) {
+        acl = make_shared<const Acl>(settings.acl);
+    }
+    for (auto &proxy : proxies) {
+        proxy->setAcl(acl);
+    }
 }
 
 
 int main(int argc, char** argv) {
-    if (argc != 3) {
-        cout << "Usage: [HTTP port] [HTTPS port]\n";
-        return 0;
+    Settings settings;
+    try {
+        if (!parse(argc, argv, settings)) {
+            return 0;
+        }
+    } catch (const exception &e) {
+        cerr << e.what() << "\nSee --help.\n";
+        return 1;
+    }
+
+    //before any thread starts, they all inherit the mask and only the signal thread waits for these
+    sigset_t requests;
+    sigemptyset(&requests);
+    sigaddset(&requests, SIGHUP);
+    sigaddset(&requests, SIGUSR1);
+    sigaddset(&requests, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &requests, nullptr);
+
+    if (!settings.trace.empty()) {
+        Trace::open(settings.trace);
+        atexit(Trace::close);
+    }
+
+    try {
+        for (unsigned i = 0; i < settings.workers; ++i) {
+            proxies.emplace_back(new Proxy(settings.bufferSize, settings.bufferPool));
+            applyStartup(*proxies.back(), settings);
+        }
+        if (!settings.capture.empty()) {
+            capture.reset(new Capture(settings.capture));
+            proxies[0]->setCapture(capture.get());
+        }
+        //loaded before warm start so that blocked origins are not warmed; aclc replaces the file in one
+        //step, and the proxies keep the previous list if the new one is unusable
+        loadAcl(settings);
+    } catch (const exception &e) {
+        cerr << e.what() << "\n";
+        return 1;
+    }
+    Latency::setSlowThreshold((uint64_t) settings.slowMillis * 1000000);
+
+    //SIGHUP reads the settings again, SIGUSR1 the ACL, SIGUSR2 prints the latency breakdown
+    thread([argc, argv, requests, settings]() mutable {
+        int sig;
+        while (sigwait(&requests, &sig) == 0) {
+            if (sig == SIGUSR2) {
+                Latency::report(cout);
+                cout.flush();
+                continue;
+            }
+            try {
+                if (sig == SIGHUP) {
+                    Settings reloaded;
+                    parse(argc, argv, reloaded);
+                    if (!reloaded.sameStartup(settings)) {
+                        cerr << "Ports, workers, buffers, files and routing change on a restart only.\n";
+                    }
+                    settings = reloaded;
+                    Latency::setSlowThreshold((uint64_t) settings.slowMillis * 1000000);
+                    for (auto &proxy : proxies) {
+                        Proxy *target = proxy.get();
+                        proxy->post([target, settings]() {
+                            applyRuntime(*target, settings);
+                        });
+                    }
+                }
+                loadAcl(settings);
+            } catch (const exception &e) {
+                cerr << e.what() << "\n";
+            }
+        }
+    }).detach();
+
+    if (!settings.warmStart.empty()) {
+        for (auto &proxy : proxies) {
+            proxy->warmStart(settings.warmStart, settings.warmConnections);
+        }
     }
 
     struct sigaction sa;
@@ -19,10 +353,31 @@ int main(int argc, char** argv) {
     sigset_t ss;
     sigemptyset(&ss);
     sigaddset(&ss,SIGTSTP);
+    sigaddset(&ss,SIGTERM);
+    sigaddset(&ss,SIGINT);
     sa.sa_mask = ss;
     sa.sa_flags = SA_SIGINFO;
     sigaction(SIGTSTP,&sa,NULL);
+    sigaction(SIGTERM,&sa,NULL);
+    sigaction(SIGINT,&sa,NULL);
 
- 
-    proxy.run(string(argv[1]),string(argv[2]));
+    //worker 0 runs here, the others on threads of their own, each with its own listeners on the same ports
+    vector<thread> workers;
+    for (unsigned i = 1; i < proxies.size(); ++i) {
+        workers.emplace_back([&settings, i]() {
+            proxies[i]->run(settings.httpPort, settings.httpsPort, settings.socksPort);
+        });
+    }
+    proxies[0]->run(settings.httpPort, settings.httpsPort, settings.socksPort);
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    if (!settings.warmStart.empty()) {
+        try {
+            Proxy::saveOrigins(settings.warmStart, proxies, 100);
+        } catch (const exception &e) {
+            cerr << e.what() << "\n";
+        }
+    }
 }
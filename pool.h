@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+/* Per-thread free list of fixed-size blocks.
+ * Blocks are recycled but only given back to the system when their thread exits, so after warm-up the
+ * accept-to-close path gets its Socket and Node memory without calling malloc. */
+template<std::size_t Size>
+class FreeList {
+    struct Block {
+        Block *next;
+    };
+
+    static thread_local Block *head;
+
+    //frees the list when the thread exits, objects from the pool should be gone by then
+    struct Release {
+        ~Release() {
+            while (head != nullptr) {
+                Block *block = head;
+                head = block->next;
+                ::operator delete(block);
+            }
+        }
+    };
+
+    static thread_local Release release;
+
+public:
+    static const std::size_t blockSize = Size < sizeof(Block) ? sizeof(Block) : Size;
+
+    static void *pull() {
+        if (head == nullptr) {
+            //registers the release of the thread, off the fast path
+            (void) &release;
+            return ::operator new(blockSize);
+        }
+        Block *block = head;
+        head = block->next;
+        return block;
+    }
+
+    static void push(void *ptr) {
+        Block *block = static_cast<Block *>(ptr);
+        block->next = head;
+        head = block;
+    }
+};
+
+template<std::size_t Size>
+thread_local typename FreeList<Size>::Block *FreeList<Size>::head = nullptr;
+
+template<std::size_t Size>
+thread_local typename FreeList<Size>::Release FreeList<Size>::release;
+
+//allocator for node-based containers and allocate_shared, single objects come from FreeList
+template<class T>
+struct PoolAllocator {
+    typedef T value_type;
+
+    PoolAllocator() = default;
+
+    template<class U>
+    PoolAllocator(const PoolAllocator<U> &) {}
+
+    T *allocate(std::size_t count) {
+        if (count == 1) {
+            return static_cast<T *>(FreeList<sizeof(T)>::pull());
+        }
+        return static_cast<T *>(::operator new(count * sizeof(T)));
+    }
+
+    void deallocate(T *ptr, std::size_t count) {
+        if (count == 1) {
+            FreeList<sizeof(T)>::push(ptr);
+        } else {
+            ::operator delete(ptr);
+        }
+    }
+
+    template<class U>
+    bool operator==(const PoolAllocator<U> &) const {
+        return true;
+    }
+
+    template<class U>
+    bool operator!=(const PoolAllocator<U> &) const {
+        return false;
+    }
+};
+
+//string with fixed inline capacity, for host names and ports stored in pooled objects
+template<unsigned Capacity>
+class InlineString {
+    char data[Capacity + 1];
+    unsigned length;
+
+public:
+    InlineString() : length(0) {
+        data[0] = '\0';
+    }
+
+    InlineString(const std::string &str) {
+        assign(str.data(), str.size());
+    }
+
+    InlineString &operator=(const std::string &str) {
+        assign(str.data(), str.size());
+        return *this;
+    }
+
+    //throws std::length_error if the value does not fit
+    void assign(const char *begin, std::size_t size) {
+        if (size > Capacity) {
+            throw std::length_error("Value does not fit into InlineString.");
+        }
+        std::memcpy(data, begin, size);
+        data[size] = '\0';
+        length = (unsigned) size;
+    }
+
+    const char *c_str() const {
+        return data;
+    }
+
+    std::size_t size() const {
+        return length;
+    }
+
+    bool empty() const {
+        return length == 0;
+    }
+
+    std::string str() const {
+        return std::string(data, length);
+    }
+
+    int compare(const char *other, std::size_t otherLength) const {
+        int result = std::memcmp(data, other, length < otherLength ? length : otherLength);
+        if (result != 0) {
+            return result;
+        }
+        return length < otherLength ? -1 : (length > otherLength ? 1 : 0);
+    }
+
+    bool operator==(const char *other) const {
+        return compare(other, std::strlen(other)) == 0;
+    }
+
+    bool operator!=(const char *other) const {
+        return !(*this == other);
+    }
+
+    bool operator==(const std::string &other) const {
+        return compare(other.data(), other.size()) == 0;
+    }
+
+    bool operator!=(const std::string &other) const {
+        return !(*this == other);
+    }
+
+    friend bool operator<(const InlineString &left, const std::string &right) {
+        return left.compare(right.data(), right.size()) < 0;
+    }
+
+    friend bool operator<(const std::string &left, const InlineString &right) {
+        return right.compare(left.data(), left.size()) > 0;
+    }
+};
@@ -2,169 +2,2052 @@
 #ifndef PROXY_PROXY_H
 #define PROXY_PROXY_H
 
-#include <queue>
+#include <arpa/inet.h>
 #include <memory>
 #include <iostream>
+#include <algorithm>
+#include <fstream>
 #include "socket.h"
+#include "trace.h"
+#include "capture.h"
+#include "pool.h"
+#include "registry.h"
+#include "shaper.h"
+#include "http2.h"
+#include "acl.h"
+#include "latency.h"
 
 using namespace std;
 
 enum class Protocol {
-    HTTP, HTTPS
+    HTTP, HTTPS, SOCKS5
 };
 
-static map<Protocol, const string> defaultPorts{{Protocol::HTTP,  "80"},
-                                                {Protocol::HTTPS, "443"}};
+enum class ConnectionClass {
+    clientHttp, clientTunnel, upstream
+};
+
+//idle: a client waiting for a request, connected: a plain HTTP pair, tunnel: a CONNECT pair,
+//deferred: a CONNECT held back while the loop is overloaded
+enum class NodeState {
+    idle, connected, tunnel, deferred
+};
+
+//where a client of the SOCKS5 listener is in its handshake, ready once its CONNECT was parsed
+enum class socksPhase : uint8_t {
+    none, greeting, auth, request, ready
+};
+
+//how an upstream group picks a parent: fewest pairs in flight, or lowest smoothed time to first byte
+//weighted by pairs in flight
+enum class Balance {
+    leastOutstanding, latency
+};
+
+/* Proxy tunables that may change while it runs, see Proxy::setLimits.
+ * deferInterval: milliseconds between retries of deferred CONNECTs, resumeBatch of them at a time
+ * maxDeferral: milliseconds before a deferred CONNECT is answered with 503
+ * maxIdle: parked keep-alive connections kept per parent
+ * resolveCache: hosts in the resolver cache before expired entries are dropped
+ * resolveSeconds: how long a resolved address is used; getaddrinfo reports no TTL */
+struct ProxyLimits {
+    unsigned deferInterval = 50, maxDeferral = 5000, resumeBatch = 64;
+    unsigned maxIdle = 8;
+    unsigned resolveCache = 4096, resolveSeconds = 60;
+};
+
+static map<Protocol, const string> defaultPorts{{Protocol::HTTP,   "80"},
+                                                {Protocol::HTTPS,  "443"},
+                                                {Protocol::SOCKS5, "1080"}};
 
 class Proxy {
     class DataStorage {
-        queue<unique_ptr<char[]>> data;
+        //used as a stack, the most recently released buffer is the warmest one
+        vector<unique_ptr<char[]>> data;
         const int dataSize;
 
+        //bytes the kernel still sends from with zero copy, kept behind the end of every buffer so that
+        //the completions, which name the buffer, need no lookup; a released buffer waits until it is unpinned
+        struct Pins {
+            unsigned long bytes = 0;
+            bool released = false;
+        };
+        const int pinsOffset;
+        //released while pinned, only freed here if still pinned at exit
+        vector<char *> waiting;
+
+        Pins &pins(const char *buffer) const {
+            return *(Pins *) (buffer + pinsOffset);
+        }
+
+        unique_ptr<char[]> allocate() const {
+            unique_ptr<char[]> buffer(new char[pinsOffset + sizeof(Pins)]);
+            new(buffer.get() + pinsOffset) Pins();
+            return buffer;
+        }
+
     public:
-        DataStorage(int pullSize, int dataSize) : dataSize(dataSize) {
+        DataStorage(int pullSize, int dataSize) : dataSize(dataSize),
+                                                   pinsOffset((dataSize + alignof(Pins) - 1) / alignof(Pins) *
+                                                              alignof(Pins)) {
             for (int i = 0; i < pullSize; ++i) {
-                data.push(make_unique<char[]>(dataSize));
+                data.push_back(allocate());
+            }
+        }
+
+        char *pull() {
+            unique_ptr<char[]> answer;
+
+            if (data.size() > 0) {
+                answer.reset(data.back().release());
+                data.pop_back();
+            } else {
+                answer = allocate();
+            }
+
+            return answer.release();
+        }
+
+        void release(char *ptr) {
+            if (pins(ptr).bytes != 0) {
+                pins(ptr).released = true;
+                waiting.push_back(ptr);
+                return;
+            }
+            data.push_back(unique_ptr<char[]>(ptr));
+        }
+
+        void pin(const char *buffer, unsigned long bytes) {
+            pins(buffer).bytes += bytes;
+        }
+
+        unsigned long pinned(const char *buffer) const {
+            return buffer == nullptr ? 0 : pins(buffer).bytes;
+        }
+
+        //a zero-copy send from buffer is done
+        void unpin(const char *buffer, unsigned size) {
+            Pins &pin = pins(buffer);
+            if ((pin.bytes -= size) == 0 && pin.released) {
+                pin.released = false;
+                waiting.erase(find(waiting.begin(), waiting.end(), buffer));
+                data.push_back(unique_ptr<char[]>(const_cast<char *>(buffer)));
+            }
+        }
+
+        ~DataStorage() {
+            for (char *buffer : waiting) {
+                delete[] buffer;
+            }
+        }
+
+    } dataStorage;
+
+    struct Node;
+
+    //a parent proxy in an upstream group
+    struct Parent {
+        string host, port;
+        unsigned outstanding = 0, failures = 0;
+        //microseconds from dispatching a request to its first byte
+        double latency = 0;
+        chrono::steady_clock::time_point ejectedUntil;
+        //keep-alive connections left over by finished plain HTTP requests
+        IntrusiveList<Node> idle;
+
+        void attach(Node &upstream) {
+            upstream.parent = this;
+            upstream.counted = true;
+            upstream.started = Trace::now();
+            ++outstanding;
+        }
+
+        //passive health check: consecutive failed pairs take the parent out of rotation for a while
+        void detach(Node &upstream) {
+            if (!upstream.counted) {
+                return;
+            }
+            upstream.counted = false;
+            --outstanding;
+            if (upstream.reason == traceReason::connectFailed || upstream.reason == traceReason::error ||
+                (upstream.reason == traceReason::closed && upstream.received == 0)) {
+                if (++failures >= EJECT_AFTER) {
+                    static const chrono::seconds ejectTime{10};
+                    failures = 0;
+                    ejectedUntil = chrono::steady_clock::now() + ejectTime;
+                }
+            } else if (upstream.received != 0) {
+                failures = 0;
+            }
+        }
+
+        void observe(uint64_t nanoseconds) {
+            static const double weight = 0.3;
+            latency = latency == 0 ? nanoseconds / 1000.0 : latency + weight * (nanoseconds / 1000.0 - latency);
+        }
+    };
+
+    struct UpstreamGroup {
+        vector<unique_ptr<Parent>> parents;
+        Balance balance = Balance::leastOutstanding;
+        //rotates the starting point so that ties are spread
+        unsigned next = 0;
+    };
+
+    //per destination host, holds the client side of every pair going there
+    struct Origin {
+        IntrusiveList<Node> connected, tunnels;
+        //upstream connections opened by warm start that have not carried a request yet
+        IntrusiveList<Node> idle;
+        unsigned long requests = 0;
+        //port of the latest request, the one warm start dials
+        InlineString<7> port;
+    };
+
+    struct Resolved {
+        Server::addressList addresses;
+        chrono::steady_clock::time_point expires;
+    };
+
+    /* A cleartext HTTP/2 connection to an origin carrying the plain HTTP requests of many clients.
+     * Each request is a stream whose upstream node has no socket: the proxy writes the response into
+     * its buffer as HTTP/1.1 and the client drains it as usual. The window advertised for a stream is
+     * returned as the client drains, so a slow client holds back its own stream only. */
+    struct H2Pool;
+
+    struct H2Link {
+        //owns the socket, its link points back here
+        unique_ptr<Node> node;
+        H2Pool *pool;
+        Proxy *proxy;
+        //frames not written yet, bytes received but not handled yet
+        string output, input;
+        size_t written = 0;
+        map<uint32_t, Node *> streams;
+        uint32_t nextStream = 1, maxStreams = 100, maxFrame = 16384;
+        //what the origin lets us send on the connection, and on a new stream
+        int64_t sendWindow = 65535, initialWindow = 65535;
+        //DATA received since the connection window was last topped up
+        unsigned long received = 0;
+        //settled: the origin answered with SETTINGS, so it speaks HTTP/2;
+        //stalled: a stream buffer is full, input waits until its client drains
+        bool settled = false, goingAway = false, stalled = false, resuming = false;
+        HpackDecoder decoder;
+        //a header block spread over CONTINUATION frames
+        string headerBlock;
+        uint32_t headerStream = 0;
+        uint8_t headerFlags = 0;
+
+        void interest() {
+            SocketWrap &socket = node->socket;
+            socketState state = socket.getState();
+            if (state != socketState::open && state != socketState::connecting) {
+                return;
+            }
+            bool write = written < output.size() || state == socketState::connecting;
+            socket.setMode(stalled ? (write ? socketMode::toWrite : socketMode::none)
+                                   : (write ? socketMode::toReadAndWrite : socketMode::toRead));
+        }
+
+        //a stream whose client went away before the response ended is cancelled
+        void forget(Node &upstream) {
+            auto iter = streams.find(upstream.stream);
+            if (iter != streams.end() && iter->second == &upstream) {
+                streams.erase(iter);
+                H2Writer::reset(output, upstream.stream, h2Error::cancel);
+                interest();
+                //the stream may be the one input waits for, nothing else would read the link again
+                if (stalled) {
+                    proxy->resume(*this);
+                }
+            }
+        }
+    };
+
+    //the links to one origin host and port
+    struct H2Pool {
+        vector<unique_ptr<H2Link>> links;
+        //after a link failed before the origin answered, requests go out as HTTP/1.1 until then
+        chrono::steady_clock::time_point fallbackUntil;
+    };
+
+    //upstream side of a request carried as an HTTP/2 stream
+    struct H2Stream {
+        //request body bytes not framed yet, and what the origin lets us send of them
+        unsigned long bodyLeft = 0;
+        int64_t sendWindow = 0;
+        //response payload the client has not drained, and drained payload not yet returned to the origin
+        unsigned unacked = 0, credit = 0;
+        bool head = false, responded = false, chunked = false, ended = false;
+    };
+
+    struct Node {
+        unique_ptr<char> buffer;
+        Node *peer;
+        unsigned size = 0, shift = 0;
+        InlineString<7> port;
+        InlineString<255> address;
+        SocketWrap socket;
+        bool isClient, untilEnd = false, crutch = false;
+        DataStorage *ds;
+        //upstream nodes share the id of their client
+        uint32_t id = 0;
+        unsigned long received = 0, sent = 0;
+        traceReason reason = traceReason::done;
+        //client side: where the node is registered, and the upstream node it owns;
+        //upstream side: the idle list of its parent or origin while it waits for a request
+        ListHook<Node> hook;
+        NodeState state = NodeState::idle;
+        socksPhase socks = socksPhase::none;
+        //client side: the port of the listener it came in on, for a Host field without one
+        const string *defaultPort = nullptr;
+        Origin *origin = nullptr;
+        unique_ptr<Node> upstream;
+        Capture *capture = nullptr;
+        chrono::steady_clock::time_point deferredSince;
+        //upstream side only: the parent proxy it goes through, when it was handed a request
+        Parent *parent = nullptr;
+        uint64_t started = 0;
+        bool counted = false;
+        //client and destination buckets, held by the client node and borrowed by its upstream node
+        TokenBucket *shaping[2] = {nullptr, nullptr};
+        //reading is paused until the buckets refill or zero-copy sends free the ring
+        bool throttled = false;
+        //the link an HTTP/2 stream goes over, null once the link is gone; on a link's own node stream is 0
+        H2Link *link = nullptr;
+        uint32_t stream = 0;
+        H2Stream h2;
+        //client side: the request in flight; upstream side: the phases of the origin connection
+        Timeline timeline;
+
+        //an idle upstream gets its buffer once it is handed a request
+        Node(DataStorage &storage, bool isClient, bool idle = false) : buffer(idle ? nullptr : storage.pull()),
+                                                                       peer(nullptr), isClient(isClient), ds(&storage) {}
+
+        //empties the ring; a buffer the kernel still sends from is swapped for another one
+        void rewind() {
+            shift = 0;
+            size = 0;
+            if (ds->pinned(buffer.get()) != 0) {
+                ds->release(buffer.release());
+                buffer.reset(ds->pull());
+            }
+        }
+
+        traceSide side() const {
+            return isClient ? traceSide::client : traceSide::upstream;
+        }
+
+        //a class derived from Node does not fit the blocks of the list
+        static void *operator new(size_t size) {
+            if (size != sizeof(Node)) {
+                return ::operator new(size);
+            }
+            return FreeList<sizeof(Node)>::pull();
+        }
+
+        static void operator delete(void *ptr, size_t size) {
+            if (size != sizeof(Node)) {
+                ::operator delete(ptr);
+                return;
+            }
+            FreeList<sizeof(Node)>::push(ptr);
+        }
+
+        void record(captureKind clientKind, captureKind upstreamKind, const char *data, uint32_t length) {
+            if (capture != nullptr && length != 0) {
+                capture->record(isClient ? clientKind : upstreamKind, id, data, length);
+            }
+        }
+
+        //takes the origin side phases from the upstream node and records the request
+        void finishRequest() {
+            if (upstream) {
+                for (latencyPhase phase : {latencyPhase::resolved, latencyPhase::connected, latencyPhase::responseByte}) {
+                    timeline.at[(unsigned) phase] = upstream->timeline.at[(unsigned) phase];
+                }
+            }
+            Latency::record(id, timeline, reason, state == NodeState::tunnel);
+        }
+
+        ~Node() {
+            Trace::record(traceEvent::close, id, side(), reason, received, sent);
+            if (isClient && timeline.reached(latencyPhase::requestByte)) {
+                timeline.mark(latencyPhase::close);
+                finishRequest();
+            }
+            record(captureKind::clientClose, captureKind::upstreamClose, (const char *) &reason, 1);
+            if (parent != nullptr) {
+                parent->detach(*this);
+            }
+            if (link != nullptr && stream != 0) {
+                link->forget(*this);
+            }
+            if (isClient) {
+                Shaper::release(shaping[0]);
+                Shaper::release(shaping[1]);
+            }
+            if (buffer) {
+                ds->release(buffer.release());
+            }
+            if (!crutch) {
+                socket.close();
+            }
+        }
+    };
+
+    map<ConnectionClass, TcpProfile> profiles;
+
+    //the registry owns every client node, each one is in exactly one list matching its state
+    IntrusiveList<Node> idleClients, deferredClients;
+    map<string, Origin, less<>> origins;
+    vector<SocketWrap> acceptedSockets;
+    vector<SocketWrap> listeners;
+    bool resumeArmed = false;
+    Capture *capture = nullptr;
+    //swapped whole by setAcl from any thread, a request keeps the list it was checked against
+    shared_ptr<const Acl> acl;
+    //user -> password for the SOCKS5 listener, no authentication while empty
+    map<string, string, less<>> socksUsers;
+    //host -> port -> address and port to dial instead
+    map<string, map<string, pair<string, string>, less<>>, less<>> redirects;
+    map<string, UpstreamGroup, less<>> groups;
+    //host -> group its requests go through, "" for every other host
+    map<string, UpstreamGroup *, less<>> routes;
+    Shaper clientShaper, destinationShaper;
+    bool sweepArmed = false;
+    //host -> port -> addresses, kept for ProxyLimits::resolveSeconds
+    map<string, map<string, Resolved, less<>>, less<>> resolved;
+    //host and port of the origins still to warm, hottest first
+    vector<pair<string, string>> warmList;
+    size_t warmNext = 0;
+    unsigned warmConnections = 0;
+    //host -> port -> HTTP/2 links to the origin, see useHttp2
+    map<string, map<string, H2Pool, less<>>, less<>> http2Pools;
+    Server server;
+    const unsigned bufferSize;
+    //the window advertised for a stream, see windowFor
+    const uint32_t streamWindow;
+    ProxyLimits limits;
+
+    void onReadSlot(Socket &socket);
+
+    void onWriteSlot(Socket &socket);
+
+    void onListenSlot(Socket &socket);
+
+    void onErrorSlot(Socket &socket);
+
+    void onConnectSlot(Socket &socket);
+
+    void onOverloadSlot(bool overloaded);
+
+    template<class Host>
+    Origin &originOf(const Host &host) {
+        auto iter = origins.find(host);
+        if (iter == origins.end()) {
+            iter = origins.emplace(piecewise_construct, forward_as_tuple(host.c_str(), host.size()),
+                                   forward_as_tuple()).first;
+        }
+        return iter->second;
+    }
+
+    void setState(Node &client, NodeState state) {
+        IntrusiveList<Node>::unlink(client);
+        client.state = state;
+        switch (state) {
+            case NodeState::idle:
+                idleClients.push_back(client);
+                break;
+            case NodeState::connected:
+                client.origin->connected.push_back(client);
+                break;
+            case NodeState::tunnel:
+                client.origin->tunnels.push_back(client);
+                break;
+            case NodeState::deferred:
+                deferredClients.push_back(client);
+                break;
+        }
+    }
+
+    template<class Host>
+    UpstreamGroup *routeOf(const Host &host) {
+        if (routes.empty()) {
+            return nullptr;
+        }
+        auto iter = routes.find(host);
+        if (iter == routes.end()) {
+            iter = routes.find("");
+        }
+        return iter == routes.end() || iter->second->parents.empty() ? nullptr : iter->second;
+    }
+
+    Parent &select(UpstreamGroup &group) {
+        auto now = chrono::steady_clock::now();
+        size_t count = group.parents.size();
+        Parent *best = nullptr;
+        double bestScore = 0;
+        for (size_t i = 0; i < count; ++i) {
+            Parent &parent = *group.parents[(group.next + i) % count];
+            if (parent.ejectedUntil > now) {
+                continue;
+            }
+            //a parent without samples scores 0 and gets probed first
+            double score = group.balance == Balance::leastOutstanding ? parent.outstanding
+                                                                      : parent.latency * (parent.outstanding + 1);
+            if (best == nullptr || score < bestScore) {
+                best = &parent;
+                bestScore = score;
+            }
+        }
+        group.next = (group.next + 1) % count;
+        if (best == nullptr) {
+            //every parent is ejected, fail open to the one that would come back first
+            best = min_element(group.parents.begin(), group.parents.end(),
+                               [](const unique_ptr<Parent> &left, const unique_ptr<Parent> &right) {
+                                   return left->ejectedUntil < right->ejectedUntil;
+                               })->get();
+        }
+        return *best;
+    }
+
+    void armSweep() {
+        if (!sweepArmed) {
+            sweepArmed = true;
+            server.addTimer(SWEEP_INTERVAL, [this]() {
+                sweepArmed = false;
+                if (clientShaper.sweep() | destinationShaper.sweep()) {
+                    armSweep();
+                }
+            });
+        }
+    }
+
+    //how much a shaped node may read now; a byte has to fit into every bucket of the pair,
+    //if one is empty reading is paused until it has refilled a little
+    unsigned allowance(Node &node, unsigned size) {
+        static const double quantum = 16 * 1024;
+        auto now = chrono::steady_clock::now();
+        double available = size;
+        uint64_t wait = 0;
+        for (TokenBucket *bucket : node.shaping) {
+            if (bucket != nullptr) {
+                bucket->refill(now);
+                available = min(available, bucket->tokens);
+                wait = max(wait, bucket->wait(min(quantum, bucket->burst)));
+            }
+        }
+        if (available >= 1) {
+            return (unsigned) available;
+        }
+        pause(node, (unsigned) (wait / 1000) + 1);
+        return 0;
+    }
+
+    void pause(Node &node, unsigned milliseconds) {
+        node.throttled = true;
+        node.socket.setMode(node.socket.getMode() == socketMode::toReadAndWrite ? socketMode::toWrite
+                                                                              : socketMode::none);
+        server.addTimer(milliseconds, [this, socket = node.socket]() mutable {
+            unthrottle(socket);
+        });
+    }
+
+    static void consume(Node &node, unsigned count) {
+        for (TokenBucket *bucket : node.shaping) {
+            if (bucket != nullptr) {
+                bucket->tokens -= count;
+            }
+        }
+    }
+
+    //the socket may be gone by the time the timer fires, closed sockets are removed before timers run
+    void unthrottle(SocketWrap &socket) {
+        if (socket.getState() != socketState::open) {
+            return;
+        }
+        Node *node = socket.getData<Node>();
+        if (!node->throttled) {
+            return;
+        }
+        node->throttled = false;
+        if (node->peer != nullptr && !node->untilEnd) {
+            socket.setMode(socket.getMode() == socketMode::toWrite ? socketMode::toReadAndWrite : socketMode::toRead);
+        }
+    }
+
+    //keeps a finished plain HTTP upstream open for the next request through the same parent
+    void park(Node &upstream) {
+        upstream.shaping[0] = upstream.shaping[1] = nullptr;
+        upstream.throttled = false;
+        upstream.parent->detach(upstream);
+        upstream.peer = nullptr;
+        upstream.shift = 0;
+        upstream.size = 0;
+        dataStorage.release(upstream.buffer.release());
+        upstream.socket.setMode(socketMode::toRead);
+        upstream.socket.setPriority(socketPriority::normal);
+        upstream.parent->idle.push_back(upstream);
+    }
+
+    //blocking on a miss, see Server::resolve
+    const addrinfo *resolve(const char *address, const char *port) {
+        chrono::seconds lifetime{limits.resolveSeconds};
+        auto now = chrono::steady_clock::now();
+        auto byAddress = resolved.find(address);
+        if (byAddress != resolved.end()) {
+            auto byPort = byAddress->second.find(port);
+            if (byPort != byAddress->second.end()) {
+                if (byPort->second.expires > now) {
+                    return byPort->second.addresses.get();
+                }
+                byAddress->second.erase(byPort);
+            }
+        } else if (resolved.size() >= limits.resolveCache) {
+            for (auto iter = resolved.begin(); iter != resolved.end();) {
+                for (auto entry = iter->second.begin(); entry != iter->second.end();) {
+                    entry = entry->second.expires > now ? next(entry) : iter->second.erase(entry);
+                }
+                iter = iter->second.empty() ? resolved.erase(iter) : next(iter);
+            }
+            if (resolved.size() >= limits.resolveCache) {
+                resolved.clear();
+            }
+        }
+        auto addresses = server.resolve(address, port);
+        return resolved[address].emplace(port, Resolved{move(addresses), now + lifetime}).first->second.addresses.get();
+    }
+
+    //connects to address:port, or to where it is redirected
+    SocketWrap dial(const char *address, const char *port, socketMode mode, Node &upstream) {
+        if (!redirects.empty()) {
+            auto byAddress = redirects.find(address);
+            if (byAddress != redirects.end()) {
+                auto byPort = byAddress->second.find(port);
+                if (byPort != byAddress->second.end()) {
+                    address = byPort->second.first.c_str();
+                    port = byPort->second.second.c_str();
+                }
+            }
+        }
+        const addrinfo *addresses = resolve(address, port);
+        upstream.timeline.mark(latencyPhase::resolved);
+        Trace::record(traceEvent::resolved, upstream.id, traceSide::upstream);
+        return server.connect(addresses, mode, &upstream, &profiles[ConnectionClass::upstream]);
+    }
+
+    Node *preconnect(const char *address, const char *port) {
+        unique_ptr<Node> upstream(new Node(dataStorage, false, true));
+        upstream->socket = dial(address, port, socketMode::toRead, *upstream);
+        return upstream.release();
+    }
+
+    //opens a few idle connections to where requests for host go, its parents or the origin itself
+    void warm(const string &host, const string &port) {
+        if (blocked(host)) {
+            return;
+        }
+        UpstreamGroup *group = routeOf(host);
+        if (group != nullptr) {
+            unsigned perParent = warmConnections < limits.maxIdle ? warmConnections : limits.maxIdle;
+            for (auto &parent : group->parents) {
+                if (warmConnections == 0) {
+                    resolve(parent->host.c_str(), parent->port.c_str());
+                }
+                while (parent->idle.size() < perParent) {
+                    Node *upstream = preconnect(parent->host.c_str(), parent->port.c_str());
+                    upstream->parent = parent.get();
+                    parent->idle.push_back(*upstream);
+                }
+            }
+            return;
+        }
+        Origin &origin = originOf(host);
+        origin.port = port;
+        if (warmConnections == 0) {
+            resolve(host.c_str(), port.c_str());
+        }
+        while (origin.idle.size() < warmConnections) {
+            origin.idle.push_back(*preconnect(host.c_str(), port.c_str()));
+        }
+    }
+
+    //one origin per loop iteration, so that early traffic is not held up behind the whole list
+    void warmStep() {
+        if (warmNext == warmList.size()) {
+            warmList.clear();
+            warmList.shrink_to_fit();
+            return;
+        }
+        auto &entry = warmList[warmNext++];
+        try {
+            warm(entry.first, entry.second);
+        } catch (...) {
+            //not resolvable now, requests for it resolve on demand
+        }
+        server.addTimer(0, [this]() {
+            warmStep();
+        });
+    }
+
+    //a parked connection that turned readable was closed by the parent or is out of step with it
+    void evict(Node &upstream) {
+        IntrusiveList<Node>::unlink(upstream);
+        delete &upstream;
+    }
+
+    //answers with a canned response and drops the client
+    void refuse(Node &client, const char *resp, unsigned size, traceReason reason) {
+        try {
+            //best effort, the reply fits into any socket buffer
+            client.socket.write((char *) resp, size);
+        } catch (...) {
+            //the client is dropped anyway
+        }
+        client.reason = reason;
+        remove(client);
+    }
+
+    //answers a request the proxy will not serve now and drops the client
+    void shed(Node &client) {
+        static const char resp[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\n"
+                                   "Content-Length: 0\r\nConnection: close\r\n\r\n";
+        static const char socksResp[] = {5, 1, 0, 1, 0, 0, 0, 0, 0, 0};
+        if (client.socks != socksPhase::none) {
+            refuse(client, socksResp, sizeof(socksResp), traceReason::shed);
+        } else {
+            refuse(client, resp, sizeof(resp) - 1, traceReason::shed);
+        }
+    }
+
+    //a destination the access list blocks, a CONNECT gets the same answer instead of its 200
+    void deny(Node &client) {
+        static const char resp[] = "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        static const char socksResp[] = {5, 2, 0, 1, 0, 0, 0, 0, 0, 0};
+        if (client.socks != socksPhase::none) {
+            refuse(client, socksResp, sizeof(socksResp), traceReason::denied);
+        } else {
+            refuse(client, resp, sizeof(resp) - 1, traceReason::denied);
+        }
+    }
+
+    //a handshake message for a SOCKS5 client, false if the socket did not take all of it
+    bool socksSend(Node &client, const char *data, unsigned size) {
+        unsigned count = 0;
+        try {
+            count = client.socket.write((char *) data, size);
+        } catch (...) {
+            return false;
+        }
+        client.record(captureKind::clientSent, captureKind::upstreamSent, data, count);
+        client.sent += count;
+        return count == size;
+    }
+
+    //RFC 1929, the user is looked up without copying it to the heap
+    bool socksAllowed(const char *user, unsigned userLength, const char *password, unsigned passwordLength) const {
+        InlineString<255> name;
+        name.assign(user, userLength);
+        auto iter = socksUsers.find(name);
+        return iter != socksUsers.end() && iter->second.size() == passwordLength &&
+               equal(password, password + passwordLength, iter->second.data());
+    }
+
+    //reads as much of the RFC 1928 handshake as the client buffer holds, each message is taken off its front;
+    //a CONNECT turns the client into a tunnel, bytes the client sent after it stay in the buffer
+    void socksStep(Node &client) {
+        auto data = (const unsigned char *) client.buffer.get();
+        while (client.size != 0 && client.socks != socksPhase::ready) {
+            unsigned used;
+            if (client.socks == socksPhase::greeting) {
+                if (data[0] != 5) {
+                    break;
+                }
+                if (client.size < 2 || client.size < 2u + data[1]) {
+                    return;
+                }
+                //username and password when users are set, no authentication otherwise
+                unsigned char method = socksUsers.empty() ? 0 : 2;
+                bool offered = find(data + 2, data + 2 + data[1], method) != data + 2 + data[1];
+                const char reply[] = {5, (char) (offered ? method : 0xff)};
+                if (!socksSend(client, reply, sizeof(reply)) || !offered) {
+                    client.reason = traceReason::denied;
+                    remove(client);
+                    return;
+                }
+                used = 2u + data[1];
+                client.socks = method == 2 ? socksPhase::auth : socksPhase::request;
+            } else if (client.socks == socksPhase::auth) {
+                if (data[0] != 1) {
+                    break;
+                }
+                unsigned userLength = client.size >= 2 ? data[1] : 0;
+                if (client.size < 3 + userLength || client.size < 3 + userLength + data[2 + userLength]) {
+                    return;
+                }
+                unsigned passwordLength = data[2 + userLength];
+                bool allowed = socksAllowed((const char *) data + 2, userLength, (const char *) data + 3 + userLength,
+                                            passwordLength);
+                const char reply[] = {1, (char) (allowed ? 0 : 1)};
+                if (!socksSend(client, reply, sizeof(reply)) || !allowed) {
+                    client.reason = traceReason::denied;
+                    remove(client);
+                    return;
+                }
+                used = 3 + userLength + passwordLength;
+                client.socks = socksPhase::request;
+            } else {
+                if (data[0] != 5) {
+                    break;
+                }
+                if (client.size < 5) {
+                    return;
+                }
+                //IPv4, domain name with its length byte, IPv6
+                unsigned length = data[3] == 1 ? 4 : (data[3] == 3 ? 1u + data[4] : (data[3] == 4 ? 16 : 0));
+                char reply[] = {5, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+                if (length == 0 || data[1] != 1) {
+                    //address type or command not supported
+                    reply[1] = length == 0 ? 8 : 7;
+                    refuse(client, reply, sizeof(reply), traceReason::error);
+                    return;
+                }
+                if (client.size < 6 + length) {
+                    return;
+                }
+                char text[INET6_ADDRSTRLEN];
+                const char *host = text;
+                size_t hostLength;
+                if (data[3] == 3) {
+                    host = (const char *) data + 5;
+                    hostLength = data[4];
+                } else {
+                    inet_ntop(data[3] == 1 ? AF_INET : AF_INET6, data + 4, text, sizeof(text));
+                    hostLength = strlen(text);
+                }
+                unsigned port = data[4 + length] << 8 | data[5 + length];
+                if (hostLength == 0 || port == 0) {
+                    reply[1] = 1;
+                    refuse(client, reply, sizeof(reply), traceReason::error);
+                    return;
+                }
+                char portText[6];
+                client.address.assign(host, hostLength);
+                client.port.assign(portText, snprintf(portText, sizeof(portText), "%u", port));
+                used = 6 + length;
+                client.socks = socksPhase::ready;
+            }
+            client.size -= used;
+            copy(client.buffer.get() + used, client.buffer.get() + used + client.size, client.buffer.get());
+        }
+        if (client.socks != socksPhase::ready) {
+            //either the next message is still to come or this is not SOCKS5
+            if (client.size != 0) {
+                client.reason = traceReason::error;
+                remove(client);
+            }
+            return;
+        }
+
+        client.timeline.mark(latencyPhase::parsed);
+        Trace::record(traceEvent::parsed, client.id, traceSide::client, traceReason::none, client.size);
+        if (blocked(client.address)) {
+            deny(client);
+            return;
+        }
+        if (server.isOverloaded()) {
+            defer(client);
+            return;
+        }
+        connect(client, true);
+    }
+
+    template<class Host>
+    bool blocked(const Host &host) const {
+        shared_ptr<const Acl> current = atomic_load(&acl);
+        return current != nullptr && current->match(host.c_str(), host.size()) == aclAction::block;
+    }
+
+    void defer(Node &client) {
+        client.socket.setMode(socketMode::none);
+        client.deferredSince = chrono::steady_clock::now();
+        setState(client, NodeState::deferred);
+        if (!resumeArmed) {
+            resumeArmed = true;
+            server.addTimer(limits.deferInterval, [this]() {
+                resumeDeferred();
+            });
+        }
+    }
+
+    //oldest first, a few at a time so that leaving overload does not bring it back at once
+    void resumeDeferred() {
+        resumeArmed = false;
+        auto now = chrono::steady_clock::now();
+        unsigned resumed = 0;
+        while (!deferredClients.empty() && resumed < limits.resumeBatch) {
+            Node *client = deferredClients.front();
+            //a deferred client is not watched, one that left meanwhile is dropped instead of dialled for
+            if (client->socket.peerGone()) {
+                client->reason = traceReason::closed;
+                remove(*client);
+            } else if (!server.isOverloaded()) {
+                ++resumed;
+                connect(*client, true);
+            } else if (chrono::duration_cast<chrono::milliseconds>(now - client->deferredSince).count() >=
+                       limits.maxDeferral) {
+                shed(*client);
+            } else {
+                break;
+            }
+        }
+        if (!deferredClients.empty()) {
+            resumeArmed = true;
+            server.addTimer(limits.deferInterval, [this]() {
+                resumeDeferred();
+            });
+        }
+    }
+
+    //drops the client together with its upstream node
+    void remove(Node &client) {
+        IntrusiveList<Node>::unlink(client);
+        delete &client;
+    }
+
+    static void clear(IntrusiveList<Node> &list) {
+        while (!list.empty()) {
+            Node *node = list.front();
+            list.erase(*node);
+            delete node;
+        }
+    }
+
+    //how much of the node's buffer may be filled, driven by the adaptive window of the socket it drains to
+    unsigned relayWindow(const Node &node) const {
+        unsigned window = node.peer != nullptr ? node.peer->socket.getWindow() : 0;
+        return (window == 0 || window > bufferSize) ? bufferSize : window;
+    }
+
+    H2Pool *http2PoolOf(const Node &client) {
+        if (http2Pools.empty()) {
+            return nullptr;
+        }
+        auto byAddress = http2Pools.find(client.address.c_str());
+        if (byAddress == http2Pools.end()) {
+            return nullptr;
+        }
+        auto byPort = byAddress->second.find(client.port.c_str());
+        if (byPort == byAddress->second.end() || byPort->second.fallbackUntil > chrono::steady_clock::now()) {
+            return nullptr;
+        }
+        return &byPort->second;
+    }
+
+    H2Link &openLink(H2Pool &pool, const char *address, const char *port) {
+        unique_ptr<H2Link> link(new H2Link);
+        link->pool = &pool;
+        link->proxy = this;
+        link->node.reset(new Node(dataStorage, false, true));
+        link->node->link = link.get();
+        link->node->id = Trace::nextConnection();
+        link->node->socket = dial(address, port, socketMode::toReadAndWrite, *link->node);
+        H2Writer::preface(link->output);
+        H2Writer::settings(link->output, {{h2Setting::enablePush,        0},
+                                          {h2Setting::initialWindowSize, streamWindow}});
+        H2Writer::windowUpdate(link->output, 0, LINK_WINDOW - 65535);
+        pool.links.push_back(move(link));
+        return *pool.links.back();
+    }
+
+    //the origin-form head in the client buffer as a header block; false for requests HTTP/2 cannot carry
+    //as they are: a chunked body, an upgrade, or anything that does not parse plainly;
+    //the head ends at the first empty line, the headSize bytes up to there are all that gets encoded
+    static bool translate(const Node &client, string &block, unsigned long &length, bool &head, unsigned &headSize) {
+        static const char lineEnd[] = "\r\n", headEnd[] = "\r\n\r\n";
+        const char *begin = client.buffer.get(), *finish = search(begin, begin + client.size, headEnd, headEnd + 4);
+        if (finish == begin + client.size) {
+            return false;
+        }
+        headSize = finish + 4 - begin;
+        finish += 2;
+        const char *line = search(begin, finish, lineEnd, lineEnd + 2);
+        const char *method = find(begin, line, ' '), *target = find(method + 1, line, ' ');
+        if (method == line || target == line || method[1] != '/') {
+            return false;
+        }
+        string fields, authority, name;
+        length = 0;
+        for (const char *start = line + 2; start < finish; start = line + 2) {
+            line = search(start, finish, lineEnd, lineEnd + 2);
+            const char *colon = find(start, line, ':'), *value = colon + 1, *end = line;
+            if (colon == line || colon == start) {
+                return false;
+            }
+            while (value != end && (*value == ' ' || *value == '\t')) {
+                ++value;
+            }
+            while (end != value && (end[-1] == ' ' || end[-1] == '\t')) {
+                --end;
+            }
+            name.assign(start, colon);
+            transform(name.begin(), name.end(), name.begin(), ::tolower);
+            if (name == "transfer-encoding" || name == "upgrade") {
+                return false;
+            }
+            if (name == "host") {
+                authority.assign(value, end);
+                continue;
+            }
+            //hop-by-hop, HTTP/2 has no use for them
+            if (name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+                (name == "te" && string(value, end) != "trailers")) {
+                continue;
+            }
+            if (name == "content-length") {
+                char *last;
+                length = strtoul(value, &last, 10);
+                if (last != end || value == end) {
+                    return false;
+                }
+            }
+            HpackEncoder::encode(fields, name.data(), name.size(), value, end - value);
+        }
+        //bytes past the body are a pipelined request, a stream cannot carry them
+        if (client.size - headSize > length) {
+            return false;
+        }
+        head = method - begin == 4 && equal(begin, method, "HEAD");
+        HpackEncoder::encode(block, ":method", 7, begin, method - begin);
+        HpackEncoder::encode(block, ":scheme", 7, "http", 4);
+        HpackEncoder::encode(block, ":authority", 10, authority.data(), authority.size());
+        HpackEncoder::encode(block, ":path", 5, method + 1, target - method - 1);
+        block += fields;
+        return true;
+    }
+
+    //sends the parsed request as a stream on a link to the origin; false leaves it to connect
+    bool openStream(Node &client, H2Pool &pool) {
+        string block;
+        unsigned long length;
+        bool head;
+        unsigned headSize;
+        //shaping works on socket reads, a shaped pair keeps a connection of its own
+        if (client.shaping[0] != nullptr || destinationShaper.shapes(client.address.c_str()) ||
+            !translate(client, block, length, head, headSize)) {
+            return false;
+        }
+        H2Link *link = nullptr;
+        for (auto &candidate : pool.links) {
+            if (!candidate->goingAway && candidate->streams.size() < candidate->maxStreams &&
+                candidate->nextStream < 0x7fffffff) {
+                link = candidate.get();
+                break;
+            }
+        }
+        if (link == nullptr) {
+            if (pool.links.size() >= MAX_LINKS) {
+                return false;
+            }
+            try {
+                link = &openLink(pool, client.address.c_str(), client.port.c_str());
+            } catch (...) {
+                return false;
+            }
+        }
+
+        unique_ptr<Node> upstream(new Node(dataStorage, false));
+        upstream->id = client.id;
+        upstream->capture = capture;
+        upstream->link = link;
+        upstream->stream = link->nextStream;
+        upstream->h2.bodyLeft = length;
+        upstream->h2.sendWindow = link->initialWindow;
+        upstream->h2.head = head;
+        link->nextStream += 2;
+        link->streams[upstream->stream] = upstream.get();
+        H2Writer::headers(link->output, upstream->stream, block, length == 0, link->maxFrame);
+        link->interest();
+
+        if (link->node->socket.getState() == socketState::open) {
+            Trace::record(traceEvent::connected, client.id, traceSide::upstream);
+        }
+        //captured as the HTTP/1.1 exchange it stands for, so that replay can serve it from a plain origin
+        if (capture != nullptr) {
+            char destination[sizeof(client.address) + sizeof(client.port)];
+            int size = snprintf(destination, sizeof(destination), "%s:%s", client.address.c_str(), client.port.c_str());
+            capture->record(captureKind::upstreamOpen, client.id, destination, size);
+        }
+        upstream->record(captureKind::clientSent, captureKind::upstreamSent, client.buffer.get(), headSize);
+        upstream->sent += headSize;
+        //what came with the head is the start of the body, it goes out as DATA
+        client.shift = headSize;
+        client.size -= headSize;
+        if (client.size == 0) {
+            client.rewind();
+        }
+
+        upstream->peer = &client;
+        client.peer = upstream.get();
+        client.upstream = move(upstream);
+        client.origin = &originOf(client.address);
+        client.origin->port = client.port;
+        ++client.origin->requests;
+        setState(client, NodeState::connected);
+        if (client.size != 0) {
+            pumpBody(*client.peer);
+        } else {
+            streamInterest(client);
+        }
+        return true;
+    }
+
+    //a client with a stream reads only the request body, and writes while the response has bytes or ended
+    void streamInterest(Node &client) {
+        Node &upstream = *client.peer;
+        bool read = upstream.h2.bodyLeft > client.size && client.size < bufferSize,
+                write = upstream.size != 0 || client.untilEnd;
+        client.socket.setMode(read ? (write ? socketMode::toReadAndWrite : socketMode::toRead)
+                                   : (write ? socketMode::toWrite : socketMode::none));
+    }
+
+    void readBody(Node &client) {
+        Node &upstream = *client.peer;
+        if (client.shift != 0) {
+            copy(client.buffer.get() + client.shift, client.buffer.get() + client.shift + client.size,
+                 client.buffer.get());
+            client.shift = 0;
+        }
+        unsigned limit = (unsigned) min<unsigned long>(bufferSize - client.size, upstream.h2.bodyLeft - client.size);
+        if (limit == 0) {
+            streamInterest(client);
+            return;
+        }
+        try {
+            unsigned count = client.socket.read(client.buffer.get() + client.size, limit);
+            client.record(captureKind::clientData, captureKind::upstreamData, client.buffer.get() + client.size, count);
+            client.size += count;
+            client.received += count;
+        } catch (...) {
+            //read left the socket in the error state, handled below
+        }
+        if (client.socket.getState() != socketState::open) {
+            onErrorSlot(client.socket.toSocket());
+            return;
+        }
+        pumpBody(upstream);
+    }
+
+    //frames what the client has buffered of the body, as far as the windows allow
+    void pumpBody(Node &upstream) {
+        Node &client = *upstream.peer;
+        H2Link &link = *upstream.link;
+        while (upstream.h2.bodyLeft != 0 && client.size != 0) {
+            int64_t length = min({upstream.h2.sendWindow, link.sendWindow, (int64_t) client.size,
+                                  (int64_t) link.maxFrame});
+            if (length <= 0) {
+                break;
+            }
+            char *data = client.buffer.get() + client.shift;
+            upstream.h2.bodyLeft -= length;
+            H2Writer::frame(link.output, h2Frame::data, upstream.h2.bodyLeft == 0 ? H2FrameHeader::endStream : 0,
+                            upstream.stream, data, (uint32_t) length);
+            upstream.record(captureKind::clientSent, captureKind::upstreamSent, data, (uint32_t) length);
+            upstream.sent += length;
+            upstream.h2.sendWindow -= length;
+            link.sendWindow -= length;
+            client.shift += length;
+            client.size -= length;
+        }
+        if (client.size == 0) {
+            client.shift = 0;
+        }
+        link.interest();
+        streamInterest(client);
+    }
+
+    //room left in the ring of an upstream node, the part zero-copy sends still read from is not free
+    unsigned long room(const Node &upstream) const {
+        return bufferSize - upstream.size - dataStorage.pinned(upstream.buffer.get());
+    }
+
+    //the caller made sure it fits
+    void append(Node &upstream, const char *data, unsigned length) {
+        unsigned end = (upstream.shift + upstream.size) % bufferSize, first = min(length, bufferSize - end);
+        copy(data, data + first, upstream.buffer.get() + end);
+        copy(data + first, data + length, upstream.buffer.get());
+        upstream.record(captureKind::clientData, captureKind::upstreamData, data, length);
+        upstream.size += length;
+        upstream.received += length;
+    }
+
+    void append(Node &upstream, const string &data) {
+        append(upstream, data.data(), (unsigned) data.size());
+    }
+
+    //the response is complete, the client goes back to idle once it has drained it
+    void finish(Node &upstream) {
+        H2Link &link = *upstream.link;
+        upstream.h2.ended = true;
+        link.streams.erase(upstream.stream);
+        if (upstream.h2.bodyLeft != 0) {
+            //the origin answered without waiting for the rest of the body
+            H2Writer::reset(link.output, upstream.stream, h2Error::noError);
+            upstream.h2.bodyLeft = 0;
+            link.interest();
+        }
+        upstream.peer->untilEnd = true;
+        streamInterest(*upstream.peer);
+    }
+
+    //answers 502 if the response has not started, otherwise the client is cut off
+    void failStream(Node &upstream) {
+        static const char resp[] = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+        if (upstream.link != nullptr) {
+            upstream.link->streams.erase(upstream.stream);
+        }
+        upstream.h2.ended = true;
+        upstream.h2.bodyLeft = 0;
+        upstream.reason = traceReason::error;
+        Node &client = *upstream.peer;
+        if (!upstream.h2.responded && room(upstream) >= sizeof(resp) - 1) {
+            upstream.h2.responded = true;
+            append(upstream, resp, sizeof(resp) - 1);
+            client.untilEnd = true;
+            streamInterest(client);
+        } else {
+            remove(client);
+        }
+    }
+
+    //RFC 7540 8.1.2 and 10.3: names are lowercase, and nothing may end a line of the HTTP/1.1 head it becomes
+    static bool acceptable(const pair<string, string> &field) {
+        auto unsafe = [](char c) { return c == '\r' || c == '\n' || c == '\0'; };
+        return !field.first.empty() &&
+               none_of(field.first.begin(), field.first.end(), [&unsafe](char c) {
+                   return unsafe(c) || isupper((unsigned char) c) || c == ' ' || c == '\t';
+               }) &&
+               find(field.first.begin() + 1, field.first.end(), ':') == field.first.end() &&
+               none_of(field.second.begin(), field.second.end(), unsafe);
+    }
+
+    //fields that concern one connection only, a trailer cannot carry them to the client
+    static bool hopByHop(const string &name) {
+        return name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "te" ||
+               name == "transfer-encoding" || name == "upgrade";
+    }
+
+    void respond(Node &upstream, const H2Headers &headers, bool endStream) {
+        string head;
+        if (!all_of(headers.begin(), headers.end(), acceptable)) {
+            H2Writer::reset(upstream.link->output, upstream.stream, h2Error::protocol);
+            failStream(upstream);
+            return;
+        }
+        if (!upstream.h2.responded) {
+            auto status = find_if(headers.begin(), headers.end(), [](const pair<string, string> &field) {
+                return field.first == ":status";
+            });
+            if (status == headers.end() || status->second.size() != 3 || status->second[0] < '1' ||
+                status->second[0] > '5' || status->second == "101") {
+                failStream(upstream);
+                return;
+            }
+            //the reason phrase may be empty
+            head = "HTTP/1.1 " + status->second + " \r\n";
+            bool length = false;
+            for (auto &field : headers) {
+                if (field.first[0] != ':') {
+                    head += field.first + ": " + field.second + "\r\n";
+                    length = length || field.first == "content-length";
+                }
+            }
+            if (status->second[0] == '1') {
+                if (endStream) {
+                    failStream(upstream);
+                    return;
+                }
+                head += "\r\n";
+            } else {
+                bool bodiless = upstream.h2.head || status->second == "204" || status->second == "304";
+                if (!length && !bodiless) {
+                    if (endStream) {
+                        head += "content-length: 0\r\n";
+                    } else {
+                        head += "transfer-encoding: chunked\r\n";
+                        upstream.h2.chunked = true;
+                    }
+                }
+                head += "\r\n";
+                upstream.h2.responded = true;
+            }
+            if (upstream.received == 0) {
+                upstream.timeline.mark(latencyPhase::responseByte);
+                Trace::record(traceEvent::firstByte, upstream.id, traceSide::upstream);
+            }
+        } else if (!endStream) {
+            failStream(upstream);
+            return;
+        } else if (upstream.h2.chunked) {
+            //trailers go after the last chunk
+            head = "0\r\n";
+            for (auto &field : headers) {
+                if (field.first[0] != ':' && !hopByHop(field.first)) {
+                    head += field.first + ": " + field.second + "\r\n";
+                }
+            }
+            head += "\r\n";
+            upstream.h2.chunked = false;
+        }
+        if (room(upstream) < head.size()) {
+            failStream(upstream);
+            return;
+        }
+        append(upstream, head);
+        if (endStream) {
+            finish(upstream);
+        } else {
+            streamInterest(*upstream.peer);
+        }
+    }
+
+    //false if the payload does not fit into the stream's buffer yet
+    bool receiveData(H2Link &link, const H2FrameHeader &frame, const char *payload) {
+        const char *data = payload;
+        uint32_t length = frame.length;
+        if ((frame.flags & H2FrameHeader::padded) != 0) {
+            if (length == 0 || (uint8_t) payload[0] >= length) {
+                throw runtime_error("Bad DATA padding.");
+            }
+            length -= 1 + (uint8_t) payload[0];
+            ++data;
+        }
+        auto iter = link.streams.find(frame.stream);
+        if (iter != link.streams.end()) {
+            Node &upstream = *iter->second;
+            bool endStream = (frame.flags & H2FrameHeader::endStream) != 0;
+            if (!upstream.h2.responded) {
+                H2Writer::reset(link.output, frame.stream, h2Error::protocol);
+                failStream(upstream);
+            } else {
+                char chunk[16];
+                int chunkLength = upstream.h2.chunked && length != 0 ? snprintf(chunk, sizeof(chunk), "%x\r\n", length) : 0;
+                unsigned long needed = length + (chunkLength != 0 ? chunkLength + 2 : 0) +
+                                       (endStream && upstream.h2.chunked ? 5 : 0);
+                if (room(upstream) < needed) {
+                    return false;
+                }
+                if (chunkLength != 0) {
+                    append(upstream, chunk, chunkLength);
+                    append(upstream, data, length);
+                    append(upstream, "\r\n", 2);
+                } else {
+                    append(upstream, data, length);
+                }
+                upstream.h2.unacked += length;
+                //padding counts against the window but never reaches the client
+                upstream.h2.credit += frame.length - length;
+                if (endStream) {
+                    if (upstream.h2.chunked) {
+                        append(upstream, "0\r\n\r\n", 5);
+                    }
+                    finish(upstream);
+                } else {
+                    streamInterest(*upstream.peer);
+                }
+            }
+        }
+        if ((link.received += frame.length) >= LINK_WINDOW / 2) {
+            H2Writer::windowUpdate(link.output, 0, (uint32_t) link.received);
+            link.received = 0;
+        }
+        return true;
+    }
+
+    void receiveHeaders(H2Link &link) {
+        H2Headers headers;
+        //decoded even for streams that are gone, the table has to stay in step with the origin's
+        link.decoder.decode(link.headerBlock.data(), link.headerBlock.size(), headers);
+        uint32_t stream = link.headerStream;
+        link.headerStream = 0;
+        link.headerBlock.clear();
+        auto iter = link.streams.find(stream);
+        if (iter != link.streams.end()) {
+            respond(*iter->second, headers, (link.headerFlags & H2FrameHeader::endStream) != 0);
+        }
+    }
+
+    void receiveSettings(H2Link &link, const H2FrameHeader &frame, const char *payload) {
+        if (frame.stream != 0 || frame.length % 6 != 0) {
+            throw runtime_error("Bad SETTINGS frame.");
+        }
+        for (uint32_t offset = 0; offset < frame.length; offset += 6) {
+            auto setting = (h2Setting) ((uint8_t) payload[offset] << 8 | (uint8_t) payload[offset + 1]);
+            uint32_t value = H2FrameHeader::read32(payload + offset + 2);
+            switch (setting) {
+                case h2Setting::maxConcurrentStreams:
+                    link.maxStreams = value;
+                    break;
+                case h2Setting::initialWindowSize:
+                    if (value > 0x7fffffff) {
+                        throw runtime_error("Bad SETTINGS_INITIAL_WINDOW_SIZE.");
+                    }
+                    for (auto &stream : link.streams) {
+                        stream.second->h2.sendWindow += (int64_t) value - link.initialWindow;
+                    }
+                    link.initialWindow = value;
+                    break;
+                case h2Setting::maxFrameSize:
+                    if (value < 16384 || value > 0xffffff) {
+                        throw runtime_error("Bad SETTINGS_MAX_FRAME_SIZE.");
+                    }
+                    link.maxFrame = value;
+                    break;
+                default:
+                    //the encoder never indexes, the others do not concern a client
+                    break;
+            }
+        }
+        H2Writer::settingsAck(link.output);
+        link.settled = true;
+    }
+
+    //streams sending a body may go on after the origin opened a window
+    void resumeBodies(H2Link &link) {
+        vector<Node *> waiting;
+        for (auto &stream : link.streams) {
+            if (stream.second->h2.bodyLeft != 0 && stream.second->peer->size != 0) {
+                waiting.push_back(stream.second);
             }
         }
+        for (Node *upstream : waiting) {
+            pumpBody(*upstream);
+        }
+    }
 
-        char *pull() {
-            unique_ptr<char[]> answer;
+    //false if the frame has to wait; throws on a connection error
+    bool receiveFrame(H2Link &link, const H2FrameHeader &frame, const char *payload) {
+        if (link.headerStream != 0 && frame.type != h2Frame::continuation) {
+            throw runtime_error("Header block interrupted.");
+        }
+        switch (frame.type) {
+            case h2Frame::data:
+                if (frame.stream == 0) {
+                    throw runtime_error("DATA on stream 0.");
+                }
+                return receiveData(link, frame, payload);
+            case h2Frame::headers: {
+                uint32_t skip = 0, padding = 0;
+                if ((frame.flags & H2FrameHeader::padded) != 0) {
+                    padding = frame.length != 0 ? (uint8_t) payload[0] : 0;
+                    skip = 1;
+                }
+                if ((frame.flags & H2FrameHeader::priority) != 0) {
+                    skip += 5;
+                }
+                if (frame.stream == 0 || skip + padding > frame.length) {
+                    throw runtime_error("Bad HEADERS frame.");
+                }
+                link.headerBlock.assign(payload + skip, frame.length - skip - padding);
+                link.headerStream = frame.stream;
+                link.headerFlags = frame.flags;
+                if ((frame.flags & H2FrameHeader::endHeaders) != 0) {
+                    receiveHeaders(link);
+                }
+                return true;
+            }
+            case h2Frame::continuation:
+                if (frame.stream != link.headerStream || frame.stream == 0 ||
+                    link.headerBlock.size() + frame.length > HpackDecoder::MAX_LIST_SIZE) {
+                    throw runtime_error("Bad CONTINUATION frame.");
+                }
+                link.headerBlock.append(payload, frame.length);
+                if ((frame.flags & H2FrameHeader::endHeaders) != 0) {
+                    receiveHeaders(link);
+                }
+                return true;
+            case h2Frame::rstStream: {
+                if (frame.length != 4 || frame.stream == 0) {
+                    throw runtime_error("Bad RST_STREAM frame.");
+                }
+                auto iter = link.streams.find(frame.stream);
+                if (iter != link.streams.end()) {
+                    failStream(*iter->second);
+                }
+                return true;
+            }
+            case h2Frame::settings:
+                if ((frame.flags & H2FrameHeader::ack) == 0) {
+                    receiveSettings(link, frame, payload);
+                    resumeBodies(link);
+                }
+                return true;
+            case h2Frame::ping:
+                if (frame.length != 8 || frame.stream != 0) {
+                    throw runtime_error("Bad PING frame.");
+                }
+                if ((frame.flags & H2FrameHeader::ack) == 0) {
+                    H2Writer::frame(link.output, h2Frame::ping, H2FrameHeader::ack, 0, payload, 8);
+                }
+                return true;
+            case h2Frame::goAway: {
+                if (frame.length < 8 || frame.stream != 0) {
+                    throw runtime_error("Bad GOAWAY frame.");
+                }
+                //streams above the last one were not processed
+                uint32_t last = H2FrameHeader::read32(payload) & 0x7fffffff;
+                link.goingAway = true;
+                while (!link.streams.empty() && link.streams.rbegin()->first > last) {
+                    failStream(*link.streams.rbegin()->second);
+                }
+                return true;
+            }
+            case h2Frame::windowUpdate: {
+                uint32_t increment = frame.length == 4 ? H2FrameHeader::read32(payload) & 0x7fffffff : 0;
+                if (increment == 0) {
+                    throw runtime_error("Bad WINDOW_UPDATE frame.");
+                }
+                if (frame.stream == 0) {
+                    if ((link.sendWindow += increment) > 0x7fffffff) {
+                        throw runtime_error("Connection window overflow.");
+                    }
+                    resumeBodies(link);
+                } else {
+                    auto iter = link.streams.find(frame.stream);
+                    if (iter != link.streams.end()) {
+                        iter->second->h2.sendWindow += increment;
+                        if (iter->second->h2.bodyLeft != 0) {
+                            pumpBody(*iter->second);
+                        }
+                    }
+                }
+                return true;
+            }
+            case h2Frame::pushPromise:
+                throw runtime_error("PUSH_PROMISE although push is disabled.");
+            default:
+                //PRIORITY and unknown frame types
+                return true;
+        }
+    }
 
-            if (data.size() > 0) {
-                answer.reset(data.front().release());
-                data.pop();
-            } else {
-                answer = make_unique<char[]>(dataSize);
+    //handles the complete frames received so far; stops at one whose stream has no room yet
+    void process(H2Link &link) {
+        size_t pos = 0;
+        link.stalled = false;
+        try {
+            while (link.input.size() - pos >= H2FrameHeader::size) {
+                H2FrameHeader frame = H2FrameHeader::parse(&link.input[pos]);
+                //no larger SETTINGS_MAX_FRAME_SIZE is advertised
+                if (frame.length > 16384) {
+                    throw runtime_error("Frame above the maximum size.");
+                }
+                if (link.input.size() - pos - H2FrameHeader::size < frame.length) {
+                    break;
+                }
+                if (!receiveFrame(link, frame, &link.input[pos + H2FrameHeader::size])) {
+                    link.stalled = true;
+                    break;
+                }
+                pos += H2FrameHeader::size + frame.length;
             }
+        } catch (const exception &) {
+            H2Writer::goAway(link.output, 0, h2Error::protocol);
+            dropLink(link);
+            return;
+        }
+        link.input.erase(0, pos);
+        if (link.goingAway && link.streams.empty()) {
+            dropLink(link);
+            return;
+        }
+        link.interest();
+    }
 
-            return answer.release();
+    void readLink(H2Link &link) {
+        static const unsigned chunk = 64 * 1024;
+        size_t size = link.input.size();
+        unsigned count = 0;
+        link.input.resize(size + chunk);
+        try {
+            count = link.node->socket.read(&link.input[size], chunk);
+        } catch (...) {
+            //read left the socket in the error state, handled below
+        }
+        link.input.resize(size + count);
+        link.node->received += count;
+        if (link.node->socket.getState() != socketState::open) {
+            dropLink(link);
+            return;
         }
+        process(link);
+    }
 
-        void release(char *ptr) {
-            data.push(unique_ptr<char[]>(ptr));
+    void writeLink(H2Link &link) {
+        unsigned count = 0;
+        try {
+            count = link.node->socket.write(&link.output[link.written], link.output.size() - link.written);
+        } catch (...) {
+            //write left the socket in the error state, handled below
         }
+        if (link.node->socket.getState() != socketState::open) {
+            dropLink(link);
+            return;
+        }
+        link.node->sent += count;
+        link.written += count;
+        if (link.written == link.output.size()) {
+            link.output.clear();
+            link.written = 0;
+        }
+        link.interest();
+    }
 
-    } dataStorage;
+    //the client drained count bytes of a stream's response, the origin may send that much more
+    void drained(Node &upstream, unsigned count) {
+        H2Link *link = upstream.link;
+        unsigned credit = min(count, upstream.h2.unacked);
+        upstream.h2.unacked -= credit;
+        upstream.h2.credit += credit;
+        if (link == nullptr) {
+            return;
+        }
+        if (!upstream.h2.ended && upstream.h2.credit >= streamWindow / 2) {
+            H2Writer::windowUpdate(link->output, upstream.stream, upstream.h2.credit);
+            upstream.h2.credit = 0;
+            link->interest();
+        }
+        if (link->stalled) {
+            resume(*link);
+        }
+    }
 
-    struct Node {
-        unique_ptr<char> buffer;
-        Node *peer;
-        unsigned size = 0, shift = 0;
-        string port, address;
-        SocketWrap socket;
-        bool isClient, untilEnd = false, crutch = false;
-        DataStorage *ds;
+    //handles the input of a stalled link again; not from here, handling input may remove the node being served
+    void resume(H2Link &link) {
+        if (link.resuming) {
+            return;
+        }
+        link.resuming = true;
+        server.addTimer(0, [this, socket = link.node->socket]() mutable {
+            if (socket.getState() == socketState::open) {
+                H2Link &link = *socket.getData<Node>()->link;
+                link.resuming = false;
+                process(link);
+            }
+        });
+    }
+
+    //fails every stream and closes the connection; an origin that never answered gets HTTP/1.1 for a while
+    void dropLink(H2Link &link) {
+        static const chrono::seconds fallback{30};
+        if (link.written < link.output.size() && link.node->socket.getState() == socketState::open) {
+            try {
+                //best effort, a GOAWAY may still fit
+                link.node->socket.write(&link.output[link.written], link.output.size() - link.written);
+            } catch (...) {
+                //closed anyway
+            }
+        }
+        auto streams = move(link.streams);
+        link.streams.clear();
+        for (auto &stream : streams) {
+            stream.second->link = nullptr;
+        }
+        for (auto &stream : streams) {
+            failStream(*stream.second);
+        }
+        H2Pool &pool = *link.pool;
+        if (!link.settled) {
+            pool.fallbackUntil = chrono::steady_clock::now() + fallback;
+        }
+        for (auto iter = pool.links.begin(); iter != pool.links.end(); ++iter) {
+            if (iter->get() == &link) {
+                pool.links.erase(iter);
+                break;
+            }
+        }
+    }
+
+public:
+    //failures in a row that eject a parent
+    static const unsigned EJECT_AFTER = 3;
+    //milliseconds between drops of shaping buckets that are full and unused
+    static const unsigned SWEEP_INTERVAL = 10000;
+    //HTTP/2 connections per origin, and the receive windows advertised for a stream and for a connection
+    static const unsigned MAX_LINKS = 4, STREAM_WINDOW = 1024 * 1024, LINK_WINDOW = 16 * 1024 * 1024;
+
+    //a stream's ring has to take a full window together with the chunked framing of its frames, otherwise a
+    //slow client would stall the whole link; frames are at most 16 KiB as no larger size is advertised
+    static uint32_t windowFor(unsigned bufferSize) {
+        //"4000\r\n" and "\r\n" around a frame, twice as drained framing is returned as window too,
+        //and the last chunk
+        static const unsigned framing = 2 * 8, last = 5;
+        unsigned reserve = (bufferSize / 16384 + 1) * framing + last;
+        return bufferSize - reserve < STREAM_WINDOW ? bufferSize - reserve : STREAM_WINDOW;
+    }
 
-        Node(DataStorage &storage, bool isClient) : buffer(storage.pull()), peer(nullptr), isClient(isClient),
-                                                    ds(&storage) {}
+    //bytes buffered per side of a pair and buffers allocated up front, fixed for the life of the proxy
+    explicit Proxy(unsigned bufferSize = 10 * 1024 * 1024, unsigned startedPool = 10)
+            : dataStorage(startedPool, bufferSize), bufferSize(bufferSize),
+              streamWindow(windowFor(bufferSize)) {
+        //request heads and small responses should not wait for Nagle
+        profiles[ConnectionClass::clientHttp].noDelay = true;
+        profiles[ConnectionClass::clientHttp].keepAliveIdle = 60;
+        profiles[ConnectionClass::clientTunnel].noDelay = true;
+        profiles[ConnectionClass::clientTunnel].notSentLowat = 128 * 1024;
+        profiles[ConnectionClass::upstream].noDelay = true;
+        profiles[ConnectionClass::upstream].keepAliveIdle = 60;
 
-        ~Node() {
-           /*if (isClient) {
-                cout << "Client drop";
-                if (address != "") {
-                    cout << address;
+        server.setSlot(boost::bind(&Proxy::onListenSlot, this, _1), socketMode::toListen);
+        server.setSlot(boost::bind(&Proxy::onReadSlot, this, _1), socketMode::toRead);
+        server.setSlot(boost::bind(&Proxy::onWriteSlot, this, _1), socketMode::toWrite);
+        server.setErrorSlot(boost::bind(&Proxy::onErrorSlot, this, _1));
+        server.setConnectSlot(boost::bind(&Proxy::onConnectSlot, this, _1));
+        server.setOverloadSlot(boost::bind(&Proxy::onOverloadSlot, this, _1));
+        server.setZeroCopySlot(boost::bind(&DataStorage::unpin, &dataStorage, _1, _2));
+    }
+
+    //takes effect for sockets created afterwards
+    void setProfile(ConnectionClass connectionClass, const TcpProfile &profile) {
+        profiles[connectionClass] = profile;
+    }
+
+    const TcpProfile &getProfile(ConnectionClass connectionClass) {
+        return profiles[connectionClass];
+    }
+
+    //when the event loop counts as overloaded, see LoadThresholds
+    void setLoadThresholds(const LoadThresholds &thresholds) {
+        server.setLoadThresholds(thresholds);
+    }
+
+    void setLimits(const ProxyLimits &limits) {
+        this->limits = limits;
+    }
+
+    const ProxyLimits &getLimits() const {
+        return limits;
+    }
+
+    //see Server::setIoBudget and Server::setBulkThreshold
+    void setIoBudget(unsigned bytes, unsigned syscalls) {
+        server.setIoBudget(bytes, syscalls);
+    }
+
+    void setBulkThreshold(unsigned long bytes) {
+        server.setBulkThreshold(bytes);
+    }
+
+    //before run, see Server::setReusePort
+    void setListenOptions(int backlog, bool reusePort) {
+        server.setListenBacklog(backlog);
+        server.setReusePort(reusePort);
+    }
+
+    //runs the task on the thread of the proxy, the way to change it while it runs
+    void post(function<void()> task) {
+        server.post(move(task));
+    }
+
+    //adds a parent proxy to the group, creating the group on first use
+    void addParent(const string &group, const string &host, const string &port) {
+        unique_ptr<Parent> parent(new Parent);
+        parent->host = host;
+        parent->port = port;
+        groups[group].parents.push_back(move(parent));
+    }
+
+    void setBalance(const string &group, Balance balance) {
+        groups[group].balance = balance;
+    }
+
+    //requests for host go through the group instead of straight to the origin, "" routes every other host
+    void route(const string &host, const string &group) {
+        routes[host] = &groups[group];
+    }
+
+    //limits what the connections of a client address move in both directions together,
+    //"" gives every other address a limit of its own
+    void shapeClient(const string &address, double bytesPerSecond, double burst) {
+        clientShaper.setRule(address, bytesPerSecond, burst);
+    }
+
+    //the same for everything going to a destination host
+    void shapeDestination(const string &host, double bytesPerSecond, double burst) {
+        destinationShaper.setRule(host, bytesPerSecond, burst);
+    }
+
+    //drops every shaping rule, connections keep their buckets and pick up rules given afterwards
+    void clearShaping() {
+        clientShaper.clearRules();
+        destinationShaper.clearRules();
+    }
+
+    //reads a list written by saveOrigins; once run has opened the listeners the origins are resolved and
+    //get this many idle connections each, or their parents do; a missing file leaves nothing to warm
+    void warmStart(const string &path, unsigned connections) {
+        ifstream file(path);
+        string host, port;
+        unsigned long requests;
+        while (file >> host >> port >> requests) {
+            warmList.emplace_back(host, port);
+        }
+        warmNext = 0;
+        warmConnections = connections;
+    }
+
+    //writes up to count origins, most requests first, summed over all the workers given; each keeps the
+    //port of the worker that sent it the most; run only once they have stopped; throws if the file cannot be written
+    static void saveOrigins(const string &path, const vector<unique_ptr<Proxy>> &workers, unsigned count) {
+        //requests, then the most of a single worker and its port
+        struct Total {
+            unsigned long requests = 0, most = 0;
+            const char *port;
+        };
+        map<string, Total, less<>> totals;
+        for (auto &worker : workers) {
+            for (auto &origin : worker->origins) {
+                if (origin.second.requests != 0 && !origin.second.port.empty()) {
+                    auto &total = totals[origin.first];
+                    total.requests += origin.second.requests;
+                    if (origin.second.requests > total.most) {
+                        total.most = origin.second.requests;
+                        total.port = origin.second.port.c_str();
+                    }
                 }
-                cout << "\n";
-            } else {
-                cout << "Server drop\n";
-            }*/
-            ds->release(buffer.release());
-            if (!crutch) {
-                socket.close();
             }
         }
-    };
-
-    list <unique_ptr<Node>> connectedClients;
-    //pain
-    map<string, vector<pair<unique_ptr<Node>, unique_ptr<Node>>>> servedNodes;
-    Server server;
+        vector<const pair<const string, Total> *> ranked;
+        for (auto &total : totals) {
+            ranked.push_back(&total);
+        }
+        auto last = ranked.begin() + min<size_t>(count, ranked.size());
+        partial_sort(ranked.begin(), last, ranked.end(),
+                     [](const pair<const string, Total> *left, const pair<const string, Total> *right) {
+                         return left->second.requests > right->second.requests;
+                     });
+
+        //replaced in one step, a crash while writing keeps the previous list
+        string temporary = path + ".tmp";
+        {
+            ofstream file(temporary, ios::trunc);
+            for (auto iter = ranked.begin(); iter != last; ++iter) {
+                file << (*iter)->first << ' ' << (*iter)->second.port << ' ' << (*iter)->second.requests
+                     << '\n';
+            }
+            if (!file.flush()) {
+                throw runtime_error("Unable to write the origin list.");
+            }
+        }
+        if (rename(temporary.c_str(), path.c_str()) < 0) {
+            throw runtime_error("Unable to write the origin list." + string(strerror(errno)));
+        }
+    }
 
-    void onReadSlot(Socket &socket);
+    //records all traffic from now on, the capture must outlive the proxy
+    void setCapture(Capture *capture) {
+        this->capture = capture;
+    }
 
-    void onWriteSlot(Socket &socket);
+    //checks the host of every request and CONNECT against the list from now on, nullptr for none;
+    //safe to call from any thread, a list is loaded before the swap and the previous one is almost
+    //always unmapped by the caller, so the loop never waits for either
+    void setAcl(shared_ptr<const Acl> acl) {
+        shared_ptr<const Acl> previous = atomic_exchange(&this->acl, move(acl));
+    }
 
-    void onListenSlot(Socket &socket);
+    //SOCKS5 clients have to authenticate as one of the users from now on, clients already in a session stay;
+    //without users the listener asks for no authentication
+    void addSocksUser(const string &user, const string &password) {
+        if (user.empty() || user.size() > 255 || password.empty() || password.size() > 255) {
+            throw runtime_error("SOCKS5 users and passwords have 1 to 255 bytes.");
+        }
+        socksUsers[user] = password;
+    }
 
-    void onErrorSlot(Socket &socket);
+    void clearSocksUsers() {
+        socksUsers.clear();
+    }
 
-public:
-    static const unsigned BUFFER_SIZE = 10 * 1024 * 1024, STARTED_POOL = 10;
+    //plain HTTP requests for host:port go out as streams over a few shared cleartext HTTP/2 connections,
+    //which the origin has to accept without an upgrade; chunked request bodies and shaped pairs still get
+    //HTTP/1.1, and so does everything for a while after a connection the origin did not answer in HTTP/2
+    void useHttp2(const string &host, const string &port) {
+        http2Pools[host][port];
+    }
 
-    Proxy() : dataStorage(STARTED_POOL, BUFFER_SIZE) {
-        server.setSlot(boost::bind(&Proxy::onListenSlot, this, _1), socketMode::toListen);
-        server.setSlot(boost::bind(&Proxy::onReadSlot, this, _1), socketMode::toRead);
-        server.setSlot(boost::bind(&Proxy::onWriteSlot, this, _1), socketMode::toWrite);
-        server.setErrorSlot(boost::bind(&Proxy::onErrorSlot, this, _1));
+    //dial toAddress:toPort whenever a request asks for address:port, used to stand in for origins
+    void redirect(const string &address, const string &port, const string &toAddress, const string &toPort) {
+        redirects[address][port] = make_pair(toAddress, toPort);
     }
 
     void listen(const string &port, Protocol protocol) {
-        server.listen(port, (void *) (&defaultPorts[protocol]));
+        listeners.push_back(
+                server.listen(port, (void *) (&defaultPorts[protocol]), &profiles[ConnectionClass::clientHttp]));
     }
 
-    void run(const string &httpPort, const string &httpsPort) {
+    //the SOCKS5 listener is left out without a port
+    void run(const string &httpPort, const string &httpsPort, const string &socksPort = "") {
         listen(httpPort, Protocol::HTTP);
         listen(httpsPort, Protocol::HTTPS);
+        if (!socksPort.empty()) {
+            listen(socksPort, Protocol::SOCKS5);
+        }
+        if (warmNext < warmList.size()) {
+            server.addTimer(0, [this]() {
+                warmStep();
+            });
+        }
         server.run();
     }
 
-    void connect(Node &node) {
-        //cout << "Connect to " + node.address + " by " +  (node.port == "80" ? "HTTP" : "HTTPS") +  "\n";
+    //makes run return, async-signal-safe
+    void stop() {
+        server.stop();
+    }
+
+    void connect(Node &node, bool tunnel) {
         unique_ptr<Node> tmpPtr;
         SocketWrap socketWrap;
+        Origin *origin = nullptr;
 
         try {
-            tmpPtr = make_unique<Node>(dataStorage, false);
-            socketWrap = server.connect(node.address, node.port, socketMode::toReadAndWrite, tmpPtr.get());
+            origin = &originOf(node.address);
+            //SOCKS5 sessions go to the destination itself, a parent would answer their CONNECT in HTTP
+            UpstreamGroup *group = node.socks == socksPhase::none ? routeOf(node.address) : nullptr;
+            Parent *parent = group != nullptr ? &select(*group) : nullptr;
+            //a tunnel through a parent needs a connection that has not carried a request
+            IntrusiveList<Node> *idle = parent == nullptr ? &origin->idle : (tunnel ? nullptr : &parent->idle);
+            if (idle != nullptr && !idle->empty()) {
+                tmpPtr.reset(idle->front());
+                idle->erase(*tmpPtr);
+                tmpPtr->buffer.reset(dataStorage.pull());
+                tmpPtr->received = tmpPtr->sent = 0;
+                tmpPtr->reason = traceReason::done;
+                tmpPtr->timeline = Timeline();
+                socketWrap = tmpPtr->socket;
+                socketWrap.setMode(socketMode::toReadAndWrite);
+            } else {
+                tmpPtr = make_unique<Node>(dataStorage, false);
+            }
+            tmpPtr->id = node.id;
+            tmpPtr->capture = capture;
+            if (parent != nullptr) {
+                parent->attach(*tmpPtr);
+            }
+            if (!socketWrap.isValid()) {
+                const char *address = parent != nullptr ? parent->host.c_str() : node.address.c_str();
+                const char *port = parent != nullptr ? parent->port.c_str() : node.port.c_str();
+                socketWrap = dial(address, port, socketMode::toReadAndWrite, *tmpPtr);
+            }
         } catch (...) {
+            if (tmpPtr) {
+                tmpPtr->reason = traceReason::connectFailed;
+            }
+            node.reason = traceReason::connectFailed;
+            if (node.socks != socksPhase::none) {
+                //host unreachable
+                static const char socksResp[] = {5, 4, 0, 1, 0, 0, 0, 0, 0, 0};
+                socksSend(node, socksResp, sizeof(socksResp));
+            }
             onErrorSlot(node.socket.toSocket());
+            return;
         }
 
         tmpPtr->socket = socketWrap;
-
-        for (auto listIter = connectedClients.begin(); listIter != connectedClients.end(); ++listIter) {
-            if (listIter->get() == &node) {
-                listIter->release();
-                connectedClients.erase(listIter);
-                break;
-            }
+        if (socketWrap.getState() == socketState::open) {
+            tmpPtr->timeline.mark(latencyPhase::connected);
+            Trace::record(traceEvent::connected, node.id, traceSide::upstream);
+        }
+        if (capture != nullptr) {
+            char destination[sizeof(node.address) + sizeof(node.port)];
+            int length = snprintf(destination, sizeof(destination), "%s:%s", node.address.c_str(), node.port.c_str());
+            capture->record(captureKind::upstreamOpen, node.id, destination, length);
         }
-
 
         Node *serverPtr = tmpPtr.get();
-        servedNodes[node.address].push_back(
-                pair<unique_ptr<Node>, unique_ptr<Node>>(unique_ptr<Node>(&node), unique_ptr<Node>(tmpPtr.release())));
+        if (!destinationShaper.empty() && (node.shaping[1] = destinationShaper.acquire(node.address.c_str()))) {
+            armSweep();
+        }
+        serverPtr->shaping[0] = node.shaping[0];
+        serverPtr->shaping[1] = node.shaping[1];
+        node.upstream = move(tmpPtr);
+        node.origin = origin;
+        node.origin->port = node.port;
+        ++node.origin->requests;
+        setState(node, tunnel ? NodeState::tunnel : NodeState::connected);
 
         node.socket.setMode(socketMode::toReadAndWrite);
 
-        if (node.port != defaultPorts[Protocol::HTTP]) {
-            string resp = "HTTP/1.1 200 Connection established\r\n\r\n";
-            copy(resp.c_str(), resp.c_str() + resp.length(), serverPtr->buffer.get());
-            serverPtr->size = resp.length();
-            node.size = 0;
+        if (tunnel) {
+            //tunnels are opaque long-lived streams, let request heads and small responses go first
+            node.socket.setPriority(socketPriority::bulk);
+            serverPtr->socket.setPriority(socketPriority::bulk);
+            try {
+                node.socket.applyProfile(&profiles[ConnectionClass::clientTunnel]);
+            } catch (...) {
+                //keep the client profile
+            }
+            //through a parent the CONNECT head is passed on and its answer comes back through the tunnel;
+            //like the 200 the SOCKS5 success goes out before the origin accepted, BND is left unspecified
+            if (node.socks != socksPhase::none) {
+                static const char resp[] = {5, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+                copy(resp, resp + sizeof(resp), serverPtr->buffer.get());
+                serverPtr->size = sizeof(resp);
+            } else if (serverPtr->parent == nullptr) {
+                static const char resp[] = "HTTP/1.1 200 Connection established\r\n\r\n";
+                copy(resp, resp + sizeof(resp) - 1, serverPtr->buffer.get());
+                serverPtr->size = sizeof(resp) - 1;
+                node.size = 0;
+            }
         }
         serverPtr->peer = &node;
         node.peer = serverPtr;
 
     }
 
-    void disconnectServer(Node& node) {
-        node.shift = 0;
-        node.size = 0;
-        auto iter = servedNodes.find(node.address);
-        for (auto listIter = iter->second.begin(); listIter != iter->second.end(); ++listIter) {
-            if (listIter->first.get() == &node) {
-                listIter->first.release();
-                node.peer = nullptr;
-                connectedClients.push_back(unique_ptr<Node>(&node));
-                iter->second.erase(listIter);
-                break;
-            }
+    //returns the upstream node if it was parked for reuse
+    Node *disconnectServer(Node& node) {
+        //the next request on the connection starts where this response ended
+        if (node.timeline.reached(latencyPhase::requestByte)) {
+            node.finishRequest();
+            uint64_t end = *max_element(node.timeline.at, node.timeline.at + Timeline::phases);
+            node.timeline = Timeline();
+            node.timeline.at[(unsigned) latencyPhase::accept] = end;
+        }
+        Node *upstream = node.upstream.get();
+        if (upstream != nullptr && upstream->parent != nullptr && node.state == NodeState::connected &&
+            !upstream->untilEnd && upstream->size == 0 && upstream->socket.getState() == socketState::open &&
+            upstream->parent->idle.size() < limits.maxIdle) {
+            park(*node.upstream.release());
+        } else {
+            upstream = nullptr;
         }
+        node.rewind();
+        Shaper::release(node.shaping[1]);
+        node.socket.setPriority(socketPriority::high);
+        node.peer = nullptr;
+        node.upstream.reset();
+        setState(node, NodeState::idle);
+        return upstream;
     }
 
-    ~Proxy() {}
+    ~Proxy() {
+        clear(idleClients);
+        clear(deferredClients);
+        for (auto &origin : origins) {
+            clear(origin.second.connected);
+            clear(origin.second.tunnels);
+            clear(origin.second.idle);
+        }
+        for (auto &group : groups) {
+            for (auto &parent : group.second.parents) {
+                clear(parent->idle);
+            }
+        }
+        http2Pools.clear();
+    }
 
 };
 
@@ -172,78 +2055,168 @@ public:
 void Proxy::onReadSlot(Socket &socket) {
     Node *ptr = socket.getData<Node>();
 
-    //In this case, we don't know on which address we should forward the request
-    if (ptr->peer == nullptr || (ptr->isClient && ptr->port == "80")) {
+    if (ptr->link != nullptr) {
+        readLink(*ptr->link);
+        return;
+    }
 
+    if (!ptr->isClient && ptr->peer == nullptr) {
+        evict(*ptr);
+        return;
+    }
+
+    //In this case, we don't know on which address we should forward the request
+    if (ptr->peer == nullptr || (ptr->isClient && ptr->state == NodeState::connected)) {
+        if (ptr->peer != nullptr && ptr->peer->stream != 0) {
+            readBody(*ptr);
+            return;
+        }
 
+        Node *parked = nullptr;
         if (ptr->peer != nullptr && ptr->size == 0) {
-            disconnectServer(*ptr);
+            parked = disconnectServer(*ptr);
         }
 
         try {
-            ptr->size += socket.read(ptr->buffer.get() + ptr->size, BUFFER_SIZE - ptr->size);
+            unsigned count = socket.read(ptr->buffer.get() + ptr->size, bufferSize - ptr->size);
+            if (count != 0 && !ptr->timeline.reached(latencyPhase::requestByte)) {
+                ptr->timeline.mark(latencyPhase::requestByte);
+            }
+            ptr->record(captureKind::clientData, captureKind::upstreamData, ptr->buffer.get() + ptr->size, count);
+            ptr->size += count;
+            ptr->received += count;
         } catch (...) {
-            onErrorSlot(socket);
-            return;
+            //read left the socket in the error state, handled below
         }
 
 
         if (socket.getState() != socketState::open) {
+            //only a new request shows the previous response was complete, a client that left may have cut it
+            if (parked != nullptr) {
+                evict(*parked);
+            }
             onErrorSlot(socket);
             return;
         }
 
-        string tmpString(ptr->buffer.get(), ptr->size);
+        if (ptr->socks != socksPhase::none) {
+            socksStep(*ptr);
+            return;
+        }
 
-        unsigned long start, end;
+        static const char headEnd[] = "\r\n\r\n", hostField[] = "Host: ", lineEnd[] = "\r\n";
+        char *begin = ptr->buffer.get(), *finish = begin + ptr->size, *start, *end;
         //Check if we got full destination address
-        if (tmpString.length() > 4 && tmpString.substr(tmpString.length() - 4) == "\r\n\r\n" &&
-            (start = tmpString.find("Host: ")) != string::npos &&
-            (end = tmpString.find("\r\n", start)) != string::npos) {
+        if (ptr->size > 4 && equal(finish - 4, finish, headEnd) &&
+            (start = search(begin, finish, hostField, hostField + 6)) != finish &&
+            (end = search(start, finish, lineEnd, lineEnd + 2)) != finish) {
             start += 6;
-            string destinationAddress = tmpString.substr(start, end - start);
-            if ((end = destinationAddress.find(":")) != string::npos) {
-                ptr->port = destinationAddress.substr(end + 1);
-                destinationAddress = destinationAddress.substr(0, end);
-
+            char *hostEnd = find(start, end, ':');
+            try {
+                //every request names its own port, a kept-alive client may go elsewhere next
+                if (hostEnd != end) {
+                    ptr->port.assign(hostEnd + 1, end - hostEnd - 1);
+                } else {
+                    ptr->port = *ptr->defaultPort;
+                }
+                ptr->address.assign(start, hostEnd - start);
+            } catch (...) {
+                onErrorSlot(socket);
+                return;
             }
 
-            unsigned long num;
-            if ((num = tmpString.find(destinationAddress)) != start) {
-                string aloha;
-                start = tmpString.find(' ');
-                aloha = tmpString.substr(0,start + 1);
-                aloha += tmpString.substr(num + destinationAddress.length());
-                copy(aloha.c_str(), aloha.c_str() + aloha.length(), ptr->buffer.get());
-                ptr->size = aloha.length();
+            static const char connectMethod[] = "CONNECT ";
+            bool tunnel = equal(connectMethod, connectMethod + 8, begin), viaParent = routeOf(ptr->address) != nullptr;
+
+            //absolute-form request line, cut the scheme and host in place unless it goes to a parent proxy
+            char *num = search(begin, finish, start, hostEnd);
+            if (num != start && !tunnel && !viaParent) {
+                char *space = find(begin, finish, ' ') + 1;
+                char *rest = num + (hostEnd - start);
+                if (rest != finish && *rest == ':') {
+                    rest = find_if(rest + 1, finish, [](char c) { return !isdigit(c); });
+                }
+                copy(rest, finish, space);
+                ptr->size -= rest - space;
+            } else if (num == start && !tunnel && viaParent) {
+                //origin-form, a parent proxy needs to see the host in the request line
+                static const char scheme[] = "http://";
+                unsigned length = sizeof(scheme) - 1 + (end - start);
+                if (ptr->size + length > bufferSize) {
+                    onErrorSlot(socket);
+                    return;
+                }
+                char *space = find(begin, finish, ' ') + 1;
+                copy_backward(space, finish, finish + length);
+                copy(start + length, end + length, copy(scheme, scheme + sizeof(scheme) - 1, space));
+                ptr->size += length;
             }
 
-            ptr->address = destinationAddress;
-            connect(*ptr);
+            ptr->timeline.mark(latencyPhase::parsed);
+            Trace::record(traceEvent::parsed, ptr->id, traceSide::client, traceReason::none, ptr->size);
+            if (blocked(ptr->address)) {
+                deny(*ptr);
+                return;
+            }
+            //established transfers keep going, and so do the next requests of a kept-alive client;
+            //the first request of a new connection waits or is refused
+            if (ptr->origin == nullptr && server.isOverloaded()) {
+                if (tunnel) {
+                    defer(*ptr);
+                } else {
+                    shed(*ptr);
+                }
+                return;
+            }
+            H2Pool *pool;
+            if (!tunnel && !viaParent && (pool = http2PoolOf(*ptr)) != nullptr && openStream(*ptr, *pool)) {
+                return;
+            }
+            connect(*ptr, tunnel);
         }
 
     } else {
-        //cout << "Read from " + ptr->address + " | " + ptr->peer->address + "\n";
         char *start;
-        unsigned size, initial_size = ptr->size;
-        if (ptr->shift + ptr->size >= BUFFER_SIZE) {
-            start = ptr->buffer.get() + (ptr->shift + ptr->size - BUFFER_SIZE);
-            size = BUFFER_SIZE - ptr->size;
+        unsigned size, initial_size = ptr->size, window = relayWindow(*ptr);
+        if (ptr->shift + ptr->size >= bufferSize) {
+            start = ptr->buffer.get() + (ptr->shift + ptr->size - bufferSize);
+            size = bufferSize - ptr->size;
         } else {
             start = ptr->buffer.get() + ptr->shift + ptr->size;
-            size = BUFFER_SIZE - ptr->shift - ptr->size;
+            size = bufferSize - ptr->shift - ptr->size;
+        }
+        size = min(size, window > ptr->size ? window - ptr->size : 0);
+        //the bytes behind shift that zero-copy sends still read from end the free part of the ring
+        unsigned long pinned = dataStorage.pinned(ptr->buffer.get());
+        if (pinned != 0 && size != 0 && (size = (unsigned) min<unsigned long>(size, bufferSize - ptr->size - pinned)) == 0) {
+            pause(*ptr, 1);
+            return;
+        }
+        bool shaped = ptr->shaping[0] != nullptr || ptr->shaping[1] != nullptr;
+        if (shaped && size != 0 && (size = allowance(*ptr, size)) == 0) {
+            return;
         }
 
         try {
-            ptr->size += socket.read(start, size);
+            unsigned count = socket.read(start, size);
+            ptr->record(captureKind::clientData, captureKind::upstreamData, start, count);
+            if (!ptr->isClient && ptr->received == 0 && count != 0) {
+                uint64_t at = ptr->timeline.mark(latencyPhase::responseByte);
+                Trace::record(traceEvent::firstByte, ptr->id, traceSide::upstream);
+                if (ptr->parent != nullptr) {
+                    ptr->parent->observe(at - ptr->started);
+                }
+            }
+            if (shaped) {
+                consume(*ptr, count);
+            }
+            ptr->size += count;
+            ptr->received += count;
         } catch (...) {
             onErrorSlot(socket);
             return;
         }
 
-
-
-
         if (socket.getState() != socketState::open) {
             onErrorSlot(socket);
         } else {
@@ -254,7 +2227,7 @@ void Proxy::onReadSlot(Socket &socket) {
                                                                                           : socketMode::toReadAndWrite;
                     ptr->socket.setMode(current_mode);
                 }
-            } else if (ptr->size == BUFFER_SIZE) {
+            } else if (ptr->size >= window) {
                 socketMode current_mode = (socket.getMode() == socketMode::toRead) ? socketMode::none
                                                                                    : socketMode::toWrite;
                 socket.setMode(current_mode);
@@ -265,40 +2238,63 @@ void Proxy::onReadSlot(Socket &socket) {
 
 void Proxy::onWriteSlot(Socket &socket) {
     Node *ptr = socket.getData<Node>();
+    if (ptr->link != nullptr) {
+        writeLink(*ptr->link);
+        return;
+    }
     ptr = ptr->peer;
 
-    //cout << "Write from " + ptr->address + " | " + ptr->peer->address + "\n";
     char *start = ptr->buffer.get() + ptr->shift;
-    unsigned size, initial_size = ptr->size;
-    if (ptr->shift + ptr->size > BUFFER_SIZE) {
-        size = BUFFER_SIZE - ptr->shift;
+    unsigned size, window = relayWindow(*ptr);
+    if (ptr->shift + ptr->size > bufferSize) {
+        size = bufferSize - ptr->shift;
     } else {
         size = ptr->size;
     }
 
+    //a plain HTTP client buffer is refilled from its start, only the rings may be sent from in place;
+    //not those of streams, the window is returned as the client drains and pinned bytes would take its room
+    bool zeroCopy = (!ptr->isClient && ptr->link == nullptr) || ptr->state == NodeState::tunnel, failed = false;
+    unsigned long pinned = socket.getPinned();
     unsigned tmp = 0;
     try {
-        tmp = socket.write(start, size);
+        tmp = socket.write(start, size, zeroCopy ? ptr->buffer.get() : nullptr);
     } catch (...) {
+        failed = true;
+    }
+    if (socket.getPinned() != pinned) {
+        dataStorage.pin(ptr->buffer.get(), socket.getPinned() - pinned);
+    }
+    if (failed) {
         onErrorSlot(socket);
         return;
     }
 
+    ptr->peer->sent += tmp;
+    ptr->peer->record(captureKind::clientSent, captureKind::upstreamSent, start, tmp);
     ptr->shift += tmp;
     ptr->size -= tmp;
-    if (ptr->shift >= BUFFER_SIZE) {
+    if (ptr->shift >= bufferSize) {
         ptr->shift = 0;
     }
+    //one clock read per drained response buffer, not per write
+    if (ptr->size == 0 && tmp != 0 && ptr->peer->isClient && ptr->peer->state != NodeState::tunnel) {
+        ptr->peer->timeline.mark(latencyPhase::lastByte);
+    }
+    if (ptr->stream != 0) {
+        drained(*ptr, tmp);
+    }
 
     if (socket.getState() != socketState::open) {
         onErrorSlot(socket);
     } else {
         if (ptr->size == 0) {
             if (ptr->peer->untilEnd) {
-                if (ptr->peer->isClient && ptr->peer->port == "80") {
-                    disconnectServer(*(ptr->peer));
+                if (ptr->peer->isClient && ptr->peer->state == NodeState::connected) {
+                    Node *client = ptr->peer;
+                    client->untilEnd = false;
+                    disconnectServer(*client);
                     socket.setMode(socketMode::toRead);
-                    ptr->peer->untilEnd = false;
                     return;
                 } else {
                     onErrorSlot(socket);
@@ -308,7 +2304,10 @@ void Proxy::onWriteSlot(Socket &socket) {
 
             socketMode current_mode = (socket.getMode() == socketMode::toWrite) ? socketMode::none : socketMode::toRead;
             socket.setMode(current_mode);
-        } else if (initial_size == BUFFER_SIZE && ptr->size != BUFFER_SIZE) {
+        }
+        //compare with the current window, it may have changed since reading was paused
+        if (ptr->size < window && !ptr->throttled && ptr->socket.getState() == socketState::open &&
+            (ptr->socket.getMode() == socketMode::none || ptr->socket.getMode() == socketMode::toWrite)) {
             socketMode current_mode = (ptr->socket.getMode() == socketMode::none ||
                                        ptr->socket.getMode() == socketMode::toRead) ? socketMode::toRead
                                                                                     : socketMode::toReadAndWrite;
@@ -318,65 +2317,81 @@ void Proxy::onWriteSlot(Socket &socket) {
 }
 
 void Proxy::onListenSlot(Socket &socket) {
-    std::vector<SocketWrap> accepted;
     try {
-        accepted = socket.accept(0);
+        socket.accept(0, acceptedSockets);
     } catch (...) {
+        acceptedSockets.clear();
         return;
     }
-    for_each(accepted.begin(), accepted.end(), [this, &socket](SocketWrap socketWrap) {
+    for_each(acceptedSockets.begin(), acceptedSockets.end(), [this, &socket](SocketWrap socketWrap) {
 
-        connectedClients.push_back(make_unique<Node>(dataStorage, true));
+        Node *client = new Node(dataStorage, true);
+        idleClients.push_back(*client);
         socketWrap.setMode(socketMode::toRead);
-        socketWrap.setData(connectedClients.back().get());
-        connectedClients.back()->socket = socketWrap;
-        connectedClients.back()->port = *socket.getData<string>();
+        socketWrap.setPriority(socketPriority::high);
+        socketWrap.setData(client);
+        client->socket = socketWrap;
+        client->defaultPort = socket.getData<string>();
+        client->port = *client->defaultPort;
+        if (socket.getData<string>() == &defaultPorts[Protocol::SOCKS5]) {
+            client->socks = socksPhase::greeting;
+        }
+        if (!clientShaper.empty() && (client->shaping[0] = clientShaper.acquire(socketWrap.getPeerAddress().c_str()))) {
+            armSweep();
+        }
+        client->id = Trace::nextConnection();
+        client->capture = capture;
+        client->record(captureKind::clientOpen, captureKind::upstreamOpen, client->port.c_str(), client->port.size());
+        client->timeline.mark(latencyPhase::accept);
+        Trace::record(traceEvent::accept, client->id, traceSide::client);
     });
+    acceptedSockets.clear();
 }
 
 
 void Proxy::onErrorSlot(Socket &socket) {
     Node *ptr = socket.getData<Node>();
+    if (ptr->reason == traceReason::done) {
+        ptr->reason = socket.getState() == socketState::error ? traceReason::error : traceReason::closed;
+    }
 
-    if (ptr->isClient) {
-        if (ptr->peer == nullptr) {
-            for (auto listIter = connectedClients.begin(); listIter != connectedClients.end(); ++listIter) {
-                if (listIter->get() == ptr) {
-                    connectedClients.erase(listIter);
-                    break;
-                }
-            }
-        } else {
+    if (ptr->link != nullptr) {
+        dropLink(*ptr->link);
+        return;
+    }
 
-            auto iter = servedNodes.find(ptr->address);
-            for (auto listIter = iter->second.begin(); listIter != iter->second.end(); ++listIter) {
-                if (listIter->first.get() == ptr) {
-                    if (ptr->untilEnd) {
-                        iter->second.erase(listIter);
-                    } else {
-                        ptr->crutch = true;
-                        ptr->socket.close();
-                        listIter->second->untilEnd = true;
-                        listIter->second->socket.setMode(socketMode::toWrite);
-                    }
-                    break;
-                }
-            }
-        }
+    if (!ptr->isClient && ptr->peer == nullptr) {
+        evict(*ptr);
+        return;
+    }
+
+    //a stream has nothing to flush towards the origin on its own
+    if ((ptr->isClient && ptr->peer == nullptr) || (ptr->peer != nullptr && ptr->peer->stream != 0)) {
+        remove(*ptr);
+    } else if (ptr->untilEnd) {
+        //the other side already failed and this one has flushed what it could
+        remove(ptr->isClient ? *ptr : *ptr->peer);
     } else {
-        auto iter = servedNodes.find(ptr->peer->address);
-        for (auto listIter = iter->second.begin(); listIter != iter->second.end(); ++listIter) {
-            if (listIter->second.get() == ptr) {
-                if (ptr->untilEnd) {
-                    iter->second.erase(listIter);
-                } else {
-                    ptr->crutch = true;
-                    ptr->socket.close();
-                    listIter->first->untilEnd = true;
-                    listIter->first->socket.setMode(socketMode::toWrite);
-                }
-                break;
-            }
+        ptr->crutch = true;
+        ptr->socket.close();
+        ptr->peer->untilEnd = true;
+        ptr->peer->socket.setMode(socketMode::toWrite);
+    }
+}
+
+void Proxy::onConnectSlot(Socket &socket) {
+    Node *ptr = socket.getData<Node>();
+    ptr->timeline.mark(latencyPhase::connected);
+    Trace::record(traceEvent::connected, ptr->id, ptr->side());
+}
+
+//pending connections wait in the listen backlog until the loop catches up
+void Proxy::onOverloadSlot(bool overloaded) {
+    for (auto &listener : listeners) {
+        try {
+            listener.setMode(overloaded ? socketMode::none : socketMode::toListen);
+        } catch (...) {
+            //keep the current mode
         }
     }
 }
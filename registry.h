@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+
+template<class T>
+class IntrusiveList;
+
+//embedded in every element, an element belongs to at most one list at a time
+template<class T>
+struct ListHook {
+    T *prev = nullptr, *next = nullptr;
+    IntrusiveList<T> *owner = nullptr;
+};
+
+/* Doubly-linked list threaded through T::hook.
+ * Does not own its elements; insertion and removal are O(1) and never allocate,
+ * and an element can be removed knowing only itself. */
+template<class T>
+class IntrusiveList {
+    T *head = nullptr, *tail = nullptr;
+    std::size_t count = 0;
+
+public:
+    IntrusiveList() = default;
+    IntrusiveList(const IntrusiveList &) = delete;
+    IntrusiveList &operator=(const IntrusiveList &) = delete;
+
+    void push_back(T &item) {
+        item.hook.prev = tail;
+        item.hook.next = nullptr;
+        item.hook.owner = this;
+        if (tail != nullptr) {
+            tail->hook.next = &item;
+        } else {
+            head = &item;
+        }
+        tail = &item;
+        ++count;
+    }
+
+    void erase(T &item) {
+        if (item.hook.prev != nullptr) {
+            item.hook.prev->hook.next = item.hook.next;
+        } else {
+            head = item.hook.next;
+        }
+        if (item.hook.next != nullptr) {
+            item.hook.next->hook.prev = item.hook.prev;
+        } else {
+            tail = item.hook.prev;
+        }
+        item.hook.prev = item.hook.next = nullptr;
+        item.hook.owner = nullptr;
+        --count;
+    }
+
+    //removes the element from whatever list holds it
+    static void unlink(T &item) {
+        if (item.hook.owner != nullptr) {
+            item.hook.owner->erase(item);
+        }
+    }
+
+    T *front() const {
+        return head;
+    }
+
+    static T *next(const T &item) {
+        return item.hook.next;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    std::size_t size() const {
+        return count;
+    }
+};
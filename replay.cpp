@@ -0,0 +1,566 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <thread>
+#include "proxy.h"
+
+/* Replays a capture written by `Proxy ... <capture file>` against a fresh proxy.
+ * Recorded clients are played through the proxy and recorded origins are played by stand-ins on
+ * loopback, the proxy is told to dial the stand-ins instead of the real destinations. Every chunk a
+ * peer sent is held back until the other side has received as much as it had when the chunk was
+ * recorded, so the replay stays causal even in --fast mode. What each side receives is compared
+ * with what the proxy sent in the recording. */
+
+typedef chrono::steady_clock::time_point timePoint;
+
+struct Chunk {
+    uint64_t time;
+    //bytes this side had received from the proxy when the chunk was recorded
+    size_t watermark;
+    string data;
+};
+
+struct Conversation {
+    bool isClient;
+    uint64_t openTime;
+    //listener for clients, "host:port" for origins
+    string target;
+    vector<Chunk> chunks;
+    //what the proxy sent to this side
+    string expected;
+    //the origin closed the connection itself once it was done
+    bool closeAfter = false;
+    bool assigned = false;
+};
+
+enum class outcome {
+    identical, diverged, stalled, unmatched
+};
+
+struct Destination;
+
+struct Endpoint {
+    Conversation *conversation = nullptr;
+    //stand-in whose conversation is picked once the first bytes arrive
+    Destination *destination = nullptr;
+    SocketWrap socket;
+    timePoint start, connected, firstSent, firstReceived;
+    size_t next = 0, offset = 0, received = 0, mismatch = string::npos;
+    bool hasConnected = false, hasSent = false, hasReceived = false, timerArmed = false, finished = false;
+};
+
+struct Destination {
+    deque<Conversation *> conversations;
+};
+
+class Replay {
+    Server server;
+    deque<Conversation> conversations;
+    deque<Endpoint> endpoints;
+    map<string, Destination> destinations;
+    //proxy listener for the recorded listener port
+    map<string, string> listeners;
+    double speed = 1;
+    bool fast = false;
+    unsigned timeout = 5000;
+    timePoint begin, lastProgress;
+    unsigned long bytes = 0;
+    char buffer[64 * 1024];
+
+    void load(const string &path);
+
+    void onRead(Socket &socket);
+    void onWrite(Socket &socket);
+    void onError(Socket &socket);
+    void onConnect(Socket &socket);
+    void onListen(Socket &socket);
+
+    void open(Conversation &conversation);
+    void pump(Endpoint &endpoint);
+    void receive(Endpoint &endpoint, const char *data, size_t size);
+    void finish(Endpoint &endpoint);
+    void check();
+    void report(bool stalled);
+
+public:
+    Replay(const string &path, double speed, bool fast, unsigned timeout);
+
+    void run();
+};
+
+static unsigned short freePort() {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (fd < 0 || bind(fd, (sockaddr *) &address, sizeof(address)) < 0 ||
+        getsockname(fd, (sockaddr *) &address, &length) < 0) {
+        throw runtime_error("Unable to find a free port.");
+    }
+    ::close(fd);
+    return ntohs(address.sin_port);
+}
+
+static bool probe(unsigned short port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    bool result = fd >= 0 && ::connect(fd, (sockaddr *) &address, sizeof(address)) == 0;
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    return result;
+}
+
+Replay::Replay(const string &path, double speed, bool fast, unsigned timeout) : speed(speed), fast(fast),
+                                                                                  timeout(timeout) {
+    load(path);
+    server.setSlot(boost::bind(&Replay::onListen, this, _1), socketMode::toListen);
+    server.setSlot(boost::bind(&Replay::onRead, this, _1), socketMode::toRead);
+    server.setSlot(boost::bind(&Replay::onWrite, this, _1), socketMode::toWrite);
+    server.setErrorSlot(boost::bind(&Replay::onError, this, _1));
+    server.setConnectSlot(boost::bind(&Replay::onConnect, this, _1));
+}
+
+void Replay::load(const string &path) {
+    ifstream file(path, ios::binary);
+    if (!file) {
+        throw runtime_error("Unable to open capture file: " + path);
+    }
+    vector<char> data((size_t) file.seekg(0, ios::end).tellg());
+    file.seekg(0).read(data.data(), data.size());
+    if (data.size() < sizeof(CaptureHeader) || memcmp(data.data(), "PXCP", 4) != 0 ||
+        reinterpret_cast<const CaptureHeader *>(data.data())->version != Capture::version) {
+        throw runtime_error("Not a capture file: " + path);
+    }
+
+    //client and upstream conversation currently open for every connection id
+    map<uint32_t, pair<Conversation *, Conversation *>> open;
+    size_t position = sizeof(CaptureHeader);
+    while (position + sizeof(CaptureRecord) <= data.size()) {
+        CaptureRecord record;
+        memcpy(&record, data.data() + position, sizeof(record));
+        position += sizeof(record);
+        if (position + record.length > data.size()) {
+            break;
+        }
+        string payload(data.data() + position, record.length);
+        position += record.length;
+
+        auto &current = open[record.connection];
+        switch (static_cast<captureKind>(record.kind)) {
+            case captureKind::clientOpen:
+            case captureKind::upstreamOpen: {
+                bool isClient = static_cast<captureKind>(record.kind) == captureKind::clientOpen;
+                conversations.push_back(Conversation{isClient, record.time, payload, {}, {}});
+                (isClient ? current.first : current.second) = &conversations.back();
+                if (!isClient) {
+                    destinations[payload].conversations.push_back(&conversations.back());
+                }
+                break;
+            }
+            case captureKind::clientData:
+            case captureKind::upstreamData: {
+                bool isClient = static_cast<captureKind>(record.kind) == captureKind::clientData;
+                Conversation *conversation = isClient ? current.first : current.second;
+                if (conversation != nullptr && !payload.empty()) {
+                    conversation->chunks.push_back(Chunk{record.time, conversation->expected.size(), payload});
+                }
+                break;
+            }
+            case captureKind::clientSent:
+            case captureKind::upstreamSent: {
+                Conversation *conversation = static_cast<captureKind>(record.kind) == captureKind::clientSent
+                                             ? current.first : current.second;
+                if (conversation != nullptr) {
+                    conversation->expected += payload;
+                }
+                break;
+            }
+            case captureKind::clientClose:
+                current.first = nullptr;
+                break;
+            case captureKind::upstreamClose:
+                if (current.second != nullptr && !payload.empty()) {
+                    current.second->closeAfter = static_cast<traceReason>(payload[0]) == traceReason::closed;
+                }
+                current.second = nullptr;
+                break;
+        }
+    }
+}
+
+void Replay::run() {
+    string httpPort = to_string(freePort()), httpsPort = to_string(freePort()), socksPort = to_string(freePort());
+    listeners["80"] = httpPort;
+    listeners["443"] = httpsPort;
+    listeners["1080"] = socksPort;
+
+    //stand-ins are created before the proxy starts so that it knows every redirect up front
+    vector<pair<string, string>> redirects;
+    for (auto &destination : destinations) {
+        string port = to_string(freePort());
+        server.listen(port, &destination.second);
+        redirects.emplace_back(destination.first, port);
+    }
+
+    thread([httpPort, httpsPort, socksPort, redirects]() {
+        Proxy proxy;
+        for (auto &redirect : redirects) {
+            size_t colon = redirect.first.rfind(':');
+            proxy.redirect(redirect.first.substr(0, colon), redirect.first.substr(colon + 1), "127.0.0.1",
+                           redirect.second);
+        }
+        proxy.run(httpPort, httpsPort, socksPort);
+    }).detach();
+    while (!probe(stoi(httpsPort))) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+
+    begin = lastProgress = chrono::steady_clock::now();
+    uint64_t first = 0;
+    for (auto &conversation : conversations) {
+        if (conversation.isClient) {
+            first = first == 0 ? conversation.openTime : min(first, conversation.openTime);
+        }
+    }
+    for (auto &conversation : conversations) {
+        if (!conversation.isClient) {
+            continue;
+        }
+        if (fast) {
+            open(conversation);
+        } else {
+            Conversation *ptr = &conversation;
+            server.addTimer((unsigned) ((conversation.openTime - first) / 1e6 / speed), [this, ptr]() {
+                open(*ptr);
+            });
+        }
+    }
+    check();
+    for (;;) {
+        server.run();
+    }
+}
+
+void Replay::open(Conversation &conversation) {
+    endpoints.emplace_back();
+    Endpoint &endpoint = endpoints.back();
+    endpoint.conversation = &conversation;
+    endpoint.start = chrono::steady_clock::now();
+    auto listener = listeners.find(conversation.target);
+    if (listener == listeners.end()) {
+        endpoint.finished = true;
+        return;
+    }
+    try {
+        endpoint.socket = server.connect("127.0.0.1", listener->second, socketMode::toRead, &endpoint);
+    } catch (...) {
+        endpoint.finished = true;
+        return;
+    }
+    if (endpoint.socket.getState() == socketState::open) {
+        onConnect(endpoint.socket.toSocket());
+    }
+}
+
+void Replay::onConnect(Socket &socket) {
+    Endpoint &endpoint = *socket.getData<Endpoint>();
+    endpoint.connected = chrono::steady_clock::now();
+    endpoint.hasConnected = true;
+    pump(endpoint);
+}
+
+void Replay::onListen(Socket &socket) {
+    Destination &destination = *socket.getData<Destination>();
+    for (auto &accepted : socket.accept(0)) {
+        endpoints.emplace_back();
+        Endpoint &endpoint = endpoints.back();
+        endpoint.start = endpoint.connected = chrono::steady_clock::now();
+        endpoint.hasConnected = true;
+        endpoint.socket = accepted;
+        accepted.setData(&endpoint);
+        accepted.setMode(socketMode::toRead);
+        //an origin that speaks first cannot be matched by what it receives
+        for (auto conversation : destination.conversations) {
+            if (!conversation->assigned) {
+                if (!conversation->chunks.empty() && conversation->chunks.front().watermark == 0) {
+                    conversation->assigned = true;
+                    endpoint.conversation = conversation;
+                    pump(endpoint);
+                }
+                break;
+            }
+        }
+        if (endpoint.conversation == nullptr) {
+            endpoint.destination = &destination;
+        }
+    }
+}
+
+void Replay::pump(Endpoint &endpoint) {
+    if (endpoint.finished || endpoint.conversation == nullptr || endpoint.socket.getState() != socketState::open) {
+        return;
+    }
+    Conversation &conversation = *endpoint.conversation;
+    auto now = chrono::steady_clock::now();
+    while (endpoint.next < conversation.chunks.size()) {
+        Chunk &chunk = conversation.chunks[endpoint.next];
+        if (endpoint.received < chunk.watermark) {
+            return;
+        }
+        //a chunk is timed once, not again after a partial write
+        if (!fast && endpoint.offset == 0) {
+            auto due = endpoint.start + chrono::nanoseconds((uint64_t) ((chunk.time - conversation.openTime) / speed));
+            if (due > now) {
+                if (!endpoint.timerArmed) {
+                    endpoint.timerArmed = true;
+                    Endpoint *ptr = &endpoint;
+                    server.addTimer((unsigned) chrono::duration_cast<chrono::milliseconds>(due - now).count(),
+                                    [this, ptr]() {
+                                        ptr->timerArmed = false;
+                                        pump(*ptr);
+                                    });
+                }
+                return;
+            }
+        }
+        unsigned written;
+        try {
+            written = endpoint.socket.write(&chunk.data[endpoint.offset], chunk.data.size() - endpoint.offset);
+        } catch (...) {
+            finish(endpoint);
+            return;
+        }
+        if (written > 0) {
+            lastProgress = now;
+        }
+        endpoint.offset += written;
+        if (endpoint.offset < chunk.data.size()) {
+            endpoint.socket.setMode(socketMode::toReadAndWrite);
+            return;
+        }
+        endpoint.offset = 0;
+        ++endpoint.next;
+        if (!endpoint.hasSent) {
+            endpoint.hasSent = true;
+            endpoint.firstSent = now;
+        }
+    }
+    endpoint.socket.setMode(socketMode::toRead);
+    if (conversation.isClient ? endpoint.received >= conversation.expected.size() : conversation.closeAfter) {
+        //the recorded client had everything it waited for, the recorded origin hung up
+        finish(endpoint);
+    }
+}
+
+void Replay::receive(Endpoint &endpoint, const char *data, size_t size) {
+    if (endpoint.conversation == nullptr) {
+        Conversation *match = nullptr;
+        for (auto conversation : endpoint.destination->conversations) {
+            if (conversation->assigned) {
+                continue;
+            }
+            if (match == nullptr) {
+                match = conversation;
+            }
+            size_t common = min(size, conversation->expected.size());
+            if (common > 0 && conversation->expected.compare(0, common, data, common) == 0) {
+                match = conversation;
+                break;
+            }
+        }
+        if (match == nullptr) {
+            finish(endpoint);
+            return;
+        }
+        match->assigned = true;
+        endpoint.conversation = match;
+    }
+
+    const string &expected = endpoint.conversation->expected;
+    if (endpoint.mismatch == string::npos) {
+        for (size_t i = 0; i < size; ++i) {
+            if (endpoint.received + i >= expected.size() || expected[endpoint.received + i] != data[i]) {
+                endpoint.mismatch = endpoint.received + i;
+                break;
+            }
+        }
+    }
+    if (!endpoint.hasReceived) {
+        endpoint.hasReceived = true;
+        endpoint.firstReceived = chrono::steady_clock::now();
+    }
+    endpoint.received += size;
+    bytes += size;
+    lastProgress = chrono::steady_clock::now();
+    pump(endpoint);
+}
+
+void Replay::onRead(Socket &socket) {
+    Endpoint &endpoint = *socket.getData<Endpoint>();
+    for (;;) {
+        unsigned count;
+        try {
+            count = socket.read(buffer, sizeof(buffer));
+        } catch (...) {
+            finish(endpoint);
+            return;
+        }
+        if (count > 0) {
+            receive(endpoint, buffer, count);
+        }
+        if (endpoint.finished) {
+            return;
+        }
+        if (socket.getState() != socketState::open) {
+            finish(endpoint);
+            return;
+        }
+        if (count < sizeof(buffer)) {
+            return;
+        }
+    }
+}
+
+void Replay::onWrite(Socket &socket) {
+    pump(*socket.getData<Endpoint>());
+}
+
+void Replay::onError(Socket &socket) {
+    finish(*socket.getData<Endpoint>());
+}
+
+void Replay::finish(Endpoint &endpoint) {
+    if (endpoint.finished) {
+        return;
+    }
+    endpoint.finished = true;
+    endpoint.socket.close();
+    lastProgress = chrono::steady_clock::now();
+}
+
+void Replay::check() {
+    bool done = true;
+    for (auto &endpoint : endpoints) {
+        if (endpoint.conversation != nullptr && endpoint.conversation->isClient && !endpoint.finished) {
+            done = false;
+            break;
+        }
+    }
+    size_t clients = 0;
+    for (auto &conversation : conversations) {
+        clients += conversation.isClient ? 1 : 0;
+    }
+    size_t opened = 0;
+    for (auto &endpoint : endpoints) {
+        opened += endpoint.conversation != nullptr && endpoint.conversation->isClient ? 1 : 0;
+    }
+    auto now = chrono::steady_clock::now();
+    if (done && opened == clients) {
+        //let the stand-ins see the proxy close its side
+        server.addTimer(100, [this]() {
+            report(false);
+        });
+        return;
+    }
+    if (now - lastProgress > chrono::milliseconds(timeout) && opened == clients) {
+        report(true);
+    }
+    server.addTimer(100, [this]() {
+        check();
+    });
+}
+
+static double percentile(vector<double> &values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    sort(values.begin(), values.end());
+    return values[min(values.size() - 1, (size_t) (p * values.size()))];
+}
+
+void Replay::report(bool stalled) {
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    unsigned counts[2][4] = {};
+    vector<double> connectLatency, firstByteLatency;
+    for (auto &endpoint : endpoints) {
+        if (endpoint.conversation == nullptr) {
+            continue;
+        }
+        Conversation &conversation = *endpoint.conversation;
+        outcome result;
+        if (endpoint.mismatch != string::npos || (endpoint.finished && endpoint.received < conversation.expected.size())) {
+            result = outcome::diverged;
+        } else if (endpoint.received < conversation.expected.size() || endpoint.next < conversation.chunks.size()) {
+            result = outcome::stalled;
+        } else {
+            result = outcome::identical;
+        }
+        ++counts[conversation.isClient ? 0 : 1][static_cast<int>(result)];
+        if (conversation.isClient && endpoint.hasConnected) {
+            connectLatency.push_back(chrono::duration<double, micro>(endpoint.connected - endpoint.start).count());
+        }
+        if (conversation.isClient && endpoint.hasSent && endpoint.hasReceived && endpoint.firstReceived > endpoint.firstSent) {
+            firstByteLatency.push_back(
+                    chrono::duration<double, micro>(endpoint.firstReceived - endpoint.firstSent).count());
+        }
+    }
+    for (auto &conversation : conversations) {
+        if (!conversation.isClient && !conversation.assigned) {
+            ++counts[1][static_cast<int>(outcome::unmatched)];
+        }
+    }
+
+    static const char *names[] = {"identical", "diverged", "stalled", "unmatched"};
+    for (int side = 0; side < 2; ++side) {
+        cout << (side == 0 ? "clients:   " : "origins:   ");
+        for (int i = 0; i < 4; ++i) {
+            cout << counts[side][i] << " " << names[i] << (i < 3 ? ", " : "\n");
+        }
+    }
+    cout << "duration:  " << seconds << " s" << (stalled ? " (stopped after no progress)" : "") << "\n";
+    cout << "throughput: " << bytes / seconds / (1024 * 1024) << " MiB/s\n";
+    cout << "connect p50/p99:    " << percentile(connectLatency, 0.5) << " / " << percentile(connectLatency, 0.99)
+         << " us\n";
+    cout << "first byte p50/p99: " << percentile(firstByteLatency, 0.5) << " / "
+         << percentile(firstByteLatency, 0.99) << " us\n";
+    cout.flush();
+    _exit(counts[0][1] + counts[0][2] + counts[1][1] + counts[1][2] == 0 ? 0 : 1);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cout << "Usage: replay <capture file> [--fast] [--speed factor] [--timeout ms]\n";
+        return 0;
+    }
+    bool fast = false;
+    double speed = 1;
+    unsigned timeout = 5000;
+    for (int i = 2; i < argc; ++i) {
+        string option = argv[i];
+        if (option == "--fast") {
+            fast = true;
+        } else if (option == "--speed" && i + 1 < argc) {
+            speed = stod(argv[++i]);
+        } else if (option == "--timeout" && i + 1 < argc) {
+            timeout = stoul(argv[++i]);
+        } else {
+            cout << "Unknown option " << option << "\n";
+            return 1;
+        }
+    }
+    try {
+        Replay(argv[1], speed, fast, timeout).run();
+    } catch (exception &e) {
+        cout << e.what() << "\n";
+        return 1;
+    }
+}
@@ -1,5 +1,7 @@
 #include "server.h"
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <fcntl.h>
@@ -11,20 +13,71 @@ Server::Server() {
     if ((epollFd = epoll_create(100)) < 0) {
         throw runtime_error("Epoll creating is failed.");
     }
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if ((wakeFd = eventfd(0, EFD_NONBLOCK)) < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) < 0) {
+        close(epollFd);
+        throw runtime_error("Unable to create the wake event.");
+    }
+}
+
+void Server::wake() {
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) < 0) {
+        //already signalled
+    }
+}
+
+void Server::stop() {
+    stopRequested = true;
+    wake();
+}
+
+void Server::post(function<void()> task) {
+    {
+        lock_guard<mutex> lock(postedMutex);
+        posted.push_back(move(task));
+    }
+    wake();
+}
+
+void Server::runPosted() {
+    vector<function<void()>> tasks;
+    {
+        lock_guard<mutex> lock(postedMutex);
+        tasks.swap(posted);
+    }
+    for (auto &task : tasks) {
+        try {
+            task();
+        } catch (...) {
+            //a failed task leaves the loop as it was
+        }
+    }
+}
+
+void Server::setListenBacklog(int backlog) {
+    listenBacklog = backlog;
+}
+
+void Server::setReusePort(bool reuse) {
+    reusePort = reuse;
 }
 
 void Server::epollChange(Socket *socket, socketMode mode) {
     auto modeCurrent = socket->mode;
-    unsigned epollMode, epollSocketMode;
+    unsigned epollMode, epollSocketMode = 0;
 
     if (modeCurrent == mode) {
         return;
     }
 
     if (modeCurrent == socketMode::none) {
-        epollMode = EPOLL_CTL_ADD;
+        epollMode = socket->draining ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
     } else if (mode == socketMode::none) {
-        epollMode = EPOLL_CTL_DEL;
+        //epoll reports EPOLLERR without asking, a socket with zero-copy sends in flight stays registered for it
+        epollMode = socket->zeroCopyPending.empty() ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
     } else {
         epollMode = EPOLL_CTL_MOD;
     }
@@ -39,6 +92,9 @@ void Server::epollChange(Socket *socket, socketMode mode) {
             break;
         case socketMode::toReadAndWrite :
             epollSocketMode = EPOLLIN | EPOLLOUT;
+            break;
+        case socketMode::none :
+            break;
     }
 
     epoll_event event;
@@ -48,11 +104,13 @@ void Server::epollChange(Socket *socket, socketMode mode) {
     if (epoll_ctl(epollFd, epollMode, socket->fd, &event) < 0) {
         throw runtime_error("Unable to set socket mode");
     }
+    socket->draining = mode == socketMode::none && epollMode != EPOLL_CTL_DEL;
 }
 
 weak_ptr<Socket> Server::addSocket(socketMode mode, socketState state, int fd) {
 
-    servedSockets.push_back(make_shared<Socket>(this, mode, state, fd));
+    servedSockets.push_back(allocate_shared<Socket>(PoolAllocator<Socket>(), this, mode, state, fd));
+    servedSockets.back()->position = prev(servedSockets.end());
 
     socketMode modeBuffer = servedSockets.back()->mode;
     servedSockets.back()->mode = socketMode::none;
@@ -71,17 +129,29 @@ weak_ptr<Socket> Server::addSocket(socketMode mode, socketState state, int fd) {
     return weak_ptr<Socket>(servedSockets.back());
 }
 
-SocketWrap Server::connect(const string &addres, const string &port, socketMode mode, void *dataPtr) {
-    addrinfo *current, *addrArray, hint;
+Server::addressList Server::resolve(const char *address, const char *port) {
+    addrinfo *addrArray, hint;
     memset(&hint, 0, sizeof(hint));
     hint.ai_family = AF_UNSPEC;
     hint.ai_socktype = SOCK_STREAM;
 
-    if (getaddrinfo(addres.c_str(), port.c_str(), &hint, &addrArray) < 0) {
+    if (getaddrinfo(address, port, &hint, &addrArray) != 0) {
         throw runtime_error("Cannot find desirable socket");
     }
 
+    return addressList(addrArray, ::freeaddrinfo);
+}
+
+SocketWrap Server::connect(const string &addres, const string &port, socketMode mode, void *dataPtr,
+                           const TcpProfile *profile) {
+    return connect(resolve(addres.c_str(), port.c_str()).get(), mode, dataPtr, profile);
+}
+
+SocketWrap Server::connect(const addrinfo *addrArray, socketMode mode, void *dataPtr, const TcpProfile *profile) {
+    const addrinfo *current;
     int tmpFd;
+    unsigned zeroCopyThreshold = 0;
+    bool adaptive = false;
 
     socketState tmpSocketState = socketState::close;
     for (current = addrArray; current != nullptr; current = current->ai_next) {
@@ -94,6 +164,18 @@ SocketWrap Server::connect(const string &addres, const string &port, socketMode
             continue;
         }
 
+        zeroCopyThreshold = 0;
+        adaptive = false;
+        if (profile != nullptr) {
+            try {
+                applyTcpProfile(tmpFd, *profile);
+                zeroCopyThreshold = profile->zeroCopyThreshold;
+                adaptive = profile->adaptive;
+            } catch (...) {
+                //options are best effort
+            }
+        }
+
         if (::connect(tmpFd, current->ai_addr, current->ai_addrlen) < 0) {
             if (errno == EINPROGRESS) {
                 tmpSocketState = socketState::connecting;
@@ -107,16 +189,18 @@ SocketWrap Server::connect(const string &addres, const string &port, socketMode
         break;
     }
 
-    ::freeaddrinfo(addrArray);
     if (current == nullptr) {
         throw runtime_error("Cannot find desirable socket");
     }
     auto tmpSocket = addSocket(mode, tmpSocketState, tmpFd);
     tmpSocket.lock()->dataPtr = dataPtr;
+    tmpSocket.lock()->profile = profile;
+    tmpSocket.lock()->zeroCopyThreshold = zeroCopyThreshold;
+    tmpSocket.lock()->adaptive = adaptive;
     return SocketWrap(tmpSocket);
 }
 
-SocketWrap Server::listen(const string &port, void *dataPtr) {
+SocketWrap Server::listen(const string &port, void *dataPtr, const TcpProfile *profile) {
     addrinfo *current, *addrArray, hint;
 
     memset(&hint, 0, sizeof(hint));
@@ -139,12 +223,18 @@ SocketWrap Server::listen(const string &port, void *dataPtr) {
             continue;
         }
 
+        int one = 1;
+        if (reusePort && setsockopt(tmpFd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+            close(tmpFd);
+            continue;
+        }
+
         if (bind(tmpFd, current->ai_addr, current->ai_addrlen) < 0) {
             close(tmpFd);
             continue;
         }
 
-        if (::listen(tmpFd, Server::listenBacklog) < 0) {
+        if (::listen(tmpFd, listenBacklog) < 0) {
             close(tmpFd);
             continue;
         }
@@ -159,6 +249,7 @@ SocketWrap Server::listen(const string &port, void *dataPtr) {
 
     auto tmpSocket = addSocket(socketMode::toListen, socketState::open, tmpFd);
     tmpSocket.lock()->dataPtr = dataPtr;
+    tmpSocket.lock()->profile = profile;
     return SocketWrap(tmpSocket);
 }
 
@@ -175,58 +266,251 @@ void Server::setErrorSlot(const slotType &slot) {
     errorSignalHolder.connect(slot);
 }
 
+void Server::setConnectSlot(const slotType &slot) {
+    connectSignalHolder.connect(slot);
+}
+
 void Server::removeErrorSlot(const slotType &slot) {
     //errorSignalHolder.disconnect(slot);
     errorSignalHolder.disconnect_all_slots();
 }
 
+void Server::setZeroCopySlot(const boost::signals2::signal<void(const char *, unsigned)>::slot_type &slot) {
+    zeroCopySignalHolder.connect(slot);
+}
+
+void Server::setIoBudget(unsigned bytes, unsigned syscalls) {
+    ioBudget = bytes;
+    syscallBudget = syscalls;
+}
+
+void Server::setBulkThreshold(unsigned long bytes) {
+    bulkThreshold = bytes;
+}
+
+void Server::handleEvent(const epoll_event &currentEvent) {
+    Socket *dataPtr = (Socket *) currentEvent.data.ptr;
+    bool failed = currentEvent.events & EPOLLERR;
+    //zero-copy completions come through the error queue, they raise EPOLLERR without an error on the socket
+    if (failed && !dataPtr->zeroCopyPending.empty()) {
+        dataPtr->completeZeroCopy();
+        int error = 0;
+        socklen_t length = sizeof(error);
+        //reading SO_ERROR clears it, the socket is marked failed here so that no slot writes into it
+        if ((failed = getsockopt(dataPtr->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) &&
+            dataPtr->state != socketState::close) {
+            dataPtr->state = socketState::error;
+        }
+        if (dataPtr->zeroCopyPending.empty()) {
+            if (dataPtr->lingering) {
+                needToRemove(dataPtr);
+                return;
+            }
+            if (dataPtr->draining) {
+                dataPtr->draining = false;
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, dataPtr->fd, nullptr);
+            }
+        }
+    }
+    //a socket registered only for its completions would be reported on every wait after a hangup
+    if (currentEvent.events & EPOLLHUP && dataPtr->draining && dataPtr->mode == socketMode::none) {
+        dataPtr->completeZeroCopy();
+        dataPtr->draining = false;
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, dataPtr->fd, nullptr);
+        if (!dataPtr->zeroCopyPending.empty()) {
+            //the peer may have closed its side before our data went out, the kernel still sends it
+            if (!dataPtr->hungUp) {
+                dataPtr->hungUp = true;
+                pollZeroCopy(dataPtr);
+            }
+        } else if (dataPtr->lingering) {
+            needToRemove(dataPtr);
+        }
+        return;
+    }
+    if (dataPtr->state != socketState::close && dataPtr->state != socketState::error && currentEvent.events & EPOLLIN) {
+        if (dataPtr->mode == socketMode::toListen) {
+            signalsHolder[socketMode::toListen](*dataPtr);
+        } else {
+            dataPtr->budgetBytes = ioBudget;
+            dataPtr->budgetCalls = syscallBudget;
+            dataPtr->budgeted = socketMode::toRead;
+            signalsHolder[socketMode::toRead](*dataPtr);
+            dataPtr->budgeted = socketMode::none;
+        }
+    }
+    if (dataPtr->state != socketState::close && dataPtr->state != socketState::error && currentEvent.events & EPOLLOUT) {
+        if (dataPtr->state == socketState::connecting) {
+            //a refused connect reports EPOLLOUT together with EPOLLERR, leave it to the error slot
+            if (!(currentEvent.events & EPOLLERR)) {
+                dataPtr->state = socketState::open;
+                socketMode modeBuffer = dataPtr->mode;
+                dataPtr->mode = socketMode::toWrite;
+                epollChange(dataPtr, modeBuffer);
+                dataPtr->mode = modeBuffer;
+                connectSignalHolder(*dataPtr);
+            }
+        } else {
+            dataPtr->budgetBytes = ioBudget;
+            dataPtr->budgetCalls = syscallBudget;
+            dataPtr->budgeted = socketMode::toWrite;
+            signalsHolder[socketMode::toWrite](*dataPtr);
+            dataPtr->budgeted = socketMode::none;
+        }
+    }
+    if (dataPtr->state != socketState::close && failed) {
+        dataPtr->state = socketState::error;
+        errorSignalHolder(*dataPtr);
+    }
+}
+
+Server::timerId Server::addTimer(unsigned milliseconds, function<void()> callback) {
+    return timers.emplace(chrono::steady_clock::now() + chrono::milliseconds(milliseconds), move(callback));
+}
+
+void Server::cancelTimer(timerId timer) {
+    timers.erase(timer);
+}
+
+void Server::fireTimers() {
+    if (timers.empty()) {
+        return;
+    }
+    auto now = chrono::steady_clock::now();
+    while (!timers.empty() && timers.begin()->first <= now) {
+        auto callback = move(timers.begin()->second);
+        timers.erase(timers.begin());
+        try {
+            callback();
+        } catch (...) {
+            //ignore exceptions from timers
+        }
+    }
+}
+
+void Server::setOverloadSlot(const boost::signals2::signal<void(bool)>::slot_type &slot) {
+    overloadSignalHolder.connect(slot);
+}
+
+void Server::setLoadThresholds(const LoadThresholds &thresholds) {
+    this->thresholds = thresholds;
+}
+
+bool Server::isOverloaded() const {
+    return overloaded;
+}
+
+LoadStats Server::getLoad() const {
+    return load;
+}
+
+void Server::sampleLoad(double iterationMicros, double backlogEvents, double lagMicros) {
+    //exponentially weighted over iterations, one slow pass does not start shedding by itself
+    static const double weight = 0.125;
+    load.iterationMicros += weight * (iterationMicros - load.iterationMicros);
+    load.backlogEvents += weight * (backlogEvents - load.backlogEvents);
+    load.lagMicros += weight * (lagMicros - load.lagMicros);
+
+    auto now = chrono::steady_clock::now();
+    if (!overloaded) {
+        if (load.iterationMicros > thresholds.iterationMicros || load.backlogEvents > thresholds.backlogEvents ||
+            load.lagMicros > thresholds.lagMicros) {
+            overloaded = true;
+            overloadStart = now;
+        } else {
+            return;
+        }
+    } else {
+        double ratio = thresholds.leaveRatio;
+        if (now - overloadStart >= chrono::milliseconds(thresholds.holdMillis) &&
+            load.iterationMicros < ratio * thresholds.iterationMicros &&
+            load.backlogEvents < ratio * thresholds.backlogEvents && load.lagMicros < ratio * thresholds.lagMicros) {
+            overloaded = false;
+        } else {
+            return;
+        }
+    }
+    try {
+        overloadSignalHolder(overloaded);
+    } catch (...) {
+        //ignore exceptions from slots
+    }
+}
+
 void Server::run(int timeOut) {
+    //while overloaded the loop wakes up at least this often so that an idle loop can recover
+    static const int loadPollMillis = 100;
     int eventCount;
     for (;;) {
-        epoll_event events[servedSockets.size()];
-        if ((eventCount = epoll_wait(epollFd, events, servedSockets.size(), timeOut)) <= 0) {
-            if (errno == EINTR) {
+        //sleep until the next timer if it comes before the caller's timeout
+        int wait = timeOut;
+        bool timerBound = false;
+        if (!timers.empty()) {
+            auto untilTimer = chrono::duration_cast<chrono::milliseconds>(
+                    timers.begin()->first - chrono::steady_clock::now()).count() + 1;
+            untilTimer = max<long long>(untilTimer, 0);
+            if (timeOut < 0 || untilTimer < timeOut) {
+                wait = (int) untilTimer;
+                timerBound = true;
+            }
+        }
+        if (overloaded && (wait < 0 || wait > loadPollMillis)) {
+            wait = loadPollMillis;
+            timerBound = true;
+        }
+
+        epoll_event events[servedSockets.size() + 2];
+        if ((eventCount = epoll_wait(epollFd, events, servedSockets.size() + 2, wait)) <= 0) {
+            if (eventCount < 0 && errno == EINTR) {
                 run(timeOut);
                 return;
             }
 
             if (eventCount == 0) {
+                if (timerBound) {
+                    fireTimers();
+                    removeClosed();
+                    if (overloaded) {
+                        sampleLoad(0, 0, 0);
+                    }
+                    continue;
+                }
                 return;
             }
 
             throw runtime_error("Epoll wait error occurred.");
         }
+        auto wake = chrono::steady_clock::now();
+        chrono::steady_clock::duration lag{0};
+        bool stopping = false, woken = false;
 
         for (int i = 0; i < eventCount; ++i) {
-            try {
-                auto currentEvent = events[i];
-
-                Socket *dataPtr = (Socket *) currentEvent.data.ptr;
-                if (dataPtr->state != socketState::close && dataPtr->state != socketState::error  && currentEvent.events & EPOLLIN) {
-                    if (dataPtr->mode == socketMode::toListen) {
-                        signalsHolder[socketMode::toListen](*dataPtr);
-                    } else {
-                        signalsHolder[socketMode::toRead](*dataPtr);
-                    }
-                }
-                if (dataPtr->state != socketState::close && dataPtr->state != socketState::error && currentEvent.events & EPOLLOUT) {
-                    if (dataPtr->state == socketState::connecting) {
-                        dataPtr->state = socketState::open;
-                        socketMode modeBuffer = dataPtr->mode;
-                        dataPtr->mode = socketMode::toWrite;
-                        epollChange(dataPtr, modeBuffer);
-                        dataPtr->mode = modeBuffer;
-                    } else {
-                        signalsHolder[socketMode::toWrite](*dataPtr);
-                    }
-                }
-                if (dataPtr->state != socketState::close && currentEvent.events & EPOLLERR) {
-                    dataPtr->state = socketState::error;
-                    errorSignalHolder(*dataPtr);
-                }
-            } catch (...) {
+            Socket *dataPtr = (Socket *) events[i].data.ptr;
+            if (dataPtr == nullptr) {
+                uint64_t count;
+                woken = read(wakeFd, &count, sizeof(count)) > 0;
+                stopping = stopRequested.exchange(false);
                 continue;
             }
+            socketPriority priority = dataPtr->priority;
+            if (dataPtr->mode == socketMode::toListen) {
+                priority = socketPriority::high;
+            } else if (dataPtr->transferred > bulkThreshold) {
+                priority = socketPriority::bulk;
+            }
+            readyQueues[static_cast<int>(priority)].push_back(events[i]);
+        }
+
+        for (auto &queue : readyQueues) {
+            for (auto &currentEvent : queue) {
+                lag = max(lag, chrono::steady_clock::now() - wake);
+                try {
+                    handleEvent(currentEvent);
+                } catch (...) {
+                    continue;
+                }
+            }
+            queue.clear();
         }
         try {
             if (signalsHolder.find(socketMode::none) != signalsHolder.end()) {
@@ -239,25 +523,99 @@ void Server::run(int timeOut) {
         } catch (...) {
             //ignore exceptions from slots
         }
-        for (auto currentPtr = toRemoveList.begin(); currentPtr != toRemoveList.end(); ++currentPtr) {
-            auto it = std::find_if(servedSockets.begin(), servedSockets.end(),
-                                   [&currentPtr](const std::shared_ptr<Socket> &ptr) {
-                                       return *currentPtr == ptr.get();
-                                   });
-            if (it != servedSockets.end()) {
-                servedSockets.erase(it);
-            }
+        removeClosed();
+        fireTimers();
+        if (woken) {
+            runPosted();
+        }
+        //timers and posted tasks may close sockets too
+        removeClosed();
+        sampleLoad(chrono::duration<double, micro>(chrono::steady_clock::now() - wake).count(), eventCount,
+                   chrono::duration<double, micro>(lag).count());
+        if (stopping) {
+            return;
         }
-        toRemoveList.clear();
     }
 }
 
 Server::~Server() {
     servedSockets.clear();
+    close(wakeFd);
     close(epollFd);
 }
 
+void Server::removeClosed() {
+    for (auto currentPtr = toRemoveList.begin(); currentPtr != toRemoveList.end(); ++currentPtr) {
+        Socket *socket = *currentPtr;
+        if (socket->zeroCopyPending.empty()) {
+            servedSockets.erase(socket->position);
+        } else if (socket->lingerExpired) {
+            //the reset on close drops the unsent data, after that nothing reads the memory
+            decltype(socket->zeroCopyPending) pending;
+            pending.swap(socket->zeroCopyPending);
+            servedSockets.erase(socket->position);
+            for (auto &send : pending) {
+                zeroCopySignalHolder(send.buffer, send.size);
+            }
+        } else {
+            lingerZeroCopy(socket);
+        }
+    }
+    toRemoveList.clear();
+}
+
+//the kernel keeps sending from the memory after close, keep the descriptor to learn when it is done
+void Server::lingerZeroCopy(Socket *socket) {
+    socket->removing = false;
+    if (socket->lingering) {
+        return;
+    }
+    socket->lingering = true;
+    //the peer still gets everything that was sent, followed by the end of the stream
+    ::shutdown(socket->fd, SHUT_WR);
+    try {
+        epollChange(socket, socketMode::none);
+        socket->mode = socketMode::none;
+    } catch (...) {
+        //the timer below still frees it
+    }
+
+    weak_ptr<Socket> weak = *socket->position;
+    addTimer(zeroCopyLinger, [this, weak]() {
+        auto socket = weak.lock();
+        if (socket) {
+            //a peer that stopped reading would hold the memory forever
+            linger option{1, 0};
+            setsockopt(socket->fd, SOL_SOCKET, SO_LINGER, &option, sizeof(option));
+            socket->lingerExpired = true;
+            needToRemove(socket.get());
+        }
+    });
+}
+
+void Server::pollZeroCopy(Socket *socket) {
+    weak_ptr<Socket> weak = *socket->position;
+    addTimer(zeroCopyPoll, [this, weak]() {
+        auto socket = weak.lock();
+        if (!socket) {
+            return;
+        }
+        socket->completeZeroCopy();
+        if (!socket->zeroCopyPending.empty()) {
+            pollZeroCopy(socket.get());
+            return;
+        }
+        socket->hungUp = false;
+        if (socket->lingering) {
+            needToRemove(socket.get());
+        }
+    });
+}
+
 void Server::needToRemove(Socket *socket) {
-    toRemoveList.push_back(socket);
+    if (!socket->removing) {
+        socket->removing = true;
+        toRemoveList.push_back(socket);
+    }
 }
 
@@ -1,18 +1,41 @@
 #pragma once
 
 #include <boost/signals2.hpp>
+#include <sys/epoll.h>
+#include <netdb.h>
 #include "socket.h"
+#include "pool.h"
 #include <memory>
 #include <vector>
 #include <map>
 #include <string>
 #include <list>
+#include <chrono>
+#include <functional>
+#include <atomic>
+#include <mutex>
 
 class Socket;
 class SocketWrap;
+struct TcpProfile;
 enum class socketMode;
 enum class socketState;
 
+/* Limits on the smoothed load of the event loop, see Server::setLoadThresholds.
+ * iteration: wall time of one pass over the ready events
+ * backlog: events returned by one epoll_wait
+ * lag: time a ready event waits in the pass before its slot runs */
+struct LoadThresholds {
+    unsigned iterationMicros = 50000, backlogEvents = 1024, lagMicros = 50000;
+    //overload ends when every value is below this share of its limit and holdMillis have passed
+    double leaveRatio = 0.5;
+    unsigned holdMillis = 1000;
+};
+
+struct LoadStats {
+    double iterationMicros = 0, backlogEvents = 0, lagMicros = 0;
+};
+
 /* Required slots
  * necessary: toRead, toWrite, toListen, and error (in setErrorSlot)
  * optional: none
@@ -25,25 +48,70 @@ class Server {
 
     typedef boost::signals2::signal<void(Socket& socket)> signalType;
 
-    std::list<std::shared_ptr<Socket>> servedSockets;
+    std::list<std::shared_ptr<Socket>, PoolAllocator<std::shared_ptr<Socket>>> servedSockets;
     std::vector<Socket*> toRemoveList;
     int epollFd;
+    //written by stop and post, registered in epoll with a null data pointer
+    int wakeFd;
+    std::atomic<bool> stopRequested{false};
+    std::mutex postedMutex;
+    std::vector<std::function<void()>> posted;
     std::map<socketMode,signalType> signalsHolder;
     signalType errorSignalHolder;
+    signalType connectSignalHolder;
+    boost::signals2::signal<void(bool overloaded)> overloadSignalHolder;
+    boost::signals2::signal<void(const char* data, unsigned size)> zeroCopySignalHolder;
+
+    //events of one epoll_wait, split by socketPriority; kept between iterations to reuse the storage
+    std::vector<epoll_event> readyQueues[3];
+    unsigned ioBudget = 256 * 1024, syscallBudget = 16;
+    unsigned long bulkThreshold = 1024 * 1024;
+    int listenBacklog = 10;
+    bool reusePort = false;
+
+    std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> timers;
+
+    LoadThresholds thresholds;
+    LoadStats load;
+    bool overloaded = false;
+    std::chrono::steady_clock::time_point overloadStart;
 
     std::weak_ptr<Socket> addSocket(socketMode mode, socketState state, int fd);
     void epollChange(Socket* socket, socketMode mode);
     void needToRemove(Socket* socket);
+    void handleEvent(const epoll_event& event);
+    void removeClosed();
+    void lingerZeroCopy(Socket* socket);
+    void pollZeroCopy(Socket* socket);
+    void fireTimers();
+    void sampleLoad(double iterationMicros, double backlogEvents, double lagMicros);
+    void wake();
+    void runPosted();
 public:
     typedef signalType::slot_type slotType;
-    static const int listenBacklog = 10;
+    typedef decltype(timers)::iterator timerId;
+    //milliseconds a closed socket waits for its zero-copy completions before it is reset
+    static const unsigned zeroCopyLinger = 30000;
+    //milliseconds between reads of the completions of a socket that hung up
+    static const unsigned zeroCopyPoll = 100;
     
     Server();
     Server(const Server&) = delete;
     ~Server();
 
-    SocketWrap connect(const std::string& address, const std::string&  port, socketMode mode, void* dataPtr);
-    SocketWrap listen(const std::string& port, void* dataPtr);
+    //profile must outlive the socket; for listen it is applied to every accepted socket
+    SocketWrap connect(const std::string& address, const std::string&  port, socketMode mode, void* dataPtr,
+                       const TcpProfile* profile = nullptr);
+    SocketWrap listen(const std::string& port, void* dataPtr, const TcpProfile* profile = nullptr);
+    //both take effect for listeners opened afterwards; with SO_REUSEPORT several servers, one per thread,
+    //can listen on the same port and the kernel spreads the connections over them
+    void setListenBacklog(int backlog);
+    void setReusePort(bool reuse);
+
+    //blocking name lookup, split from connect so callers can time or cache it
+    typedef std::unique_ptr<addrinfo, void (*)(addrinfo*)> addressList;
+    addressList resolve(const char* address, const char* port);
+    SocketWrap connect(const addrinfo* addresses, socketMode mode, void* dataPtr, const TcpProfile* profile = nullptr);
 
     //do not pass toReadAndWrite via mode
     void setSlot(const slotType&  slot, socketMode mode);
@@ -51,7 +119,35 @@ public:
 
     void setErrorSlot(const slotType& slot);
     void removeErrorSlot(const slotType& slot);
+
+    //called when a non-blocking connect completes
+    void setConnectSlot(const slotType& slot);
+
+    //bytes and syscalls a socket may spend per read or write event; level-triggered epoll
+    //reports a socket that stopped on its budget again on the next iteration
+    void setIoBudget(unsigned bytes, unsigned syscalls);
+    //sockets that moved more than this since their last setPriority are served as bulk
+    void setBulkThreshold(unsigned long bytes);
+
+    //called with true when the loop starts falling behind and with false once it has recovered
+    void setOverloadSlot(const boost::signals2::signal<void(bool)>::slot_type& slot);
+    void setLoadThresholds(const LoadThresholds& thresholds);
+    bool isOverloaded() const;
+    LoadStats getLoad() const;
+
+    //called with the buffer given to Socket::write and the bytes of a zero-copy send once the kernel no longer
+    //reads them, until then they must not change; sends are released in the order they were made, also for
+    //sockets that were closed in the meantime
+    void setZeroCopySlot(const boost::signals2::signal<void(const char*, unsigned)>::slot_type& slot);
+
+    //one-shot callback from the event loop; a timer may be cancelled only before it fires
+    timerId addTimer(unsigned milliseconds, std::function<void()> callback);
+    void cancelTimer(timerId timer);
     
     void run(int timeOut = -1);
+    //makes run return after the current iteration; async-signal-safe
+    void stop();
+    //runs the task on the loop thread at the end of an iteration, may be called from any thread
+    void post(std::function<void()> task);
 
 };
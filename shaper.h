@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <string>
+#include <tuple>
+
+//bytes per second with a burst allowance, starts full
+struct TokenBucket {
+    double rate, burst, tokens;
+    std::chrono::steady_clock::time_point last;
+    //connections drawing from the bucket
+    unsigned users = 0;
+
+    TokenBucket(double rate, double burst) : rate(rate), burst(burst), tokens(burst),
+                                             last(std::chrono::steady_clock::now()) {}
+
+    void refill(std::chrono::steady_clock::time_point now) {
+        tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - last).count());
+        last = now;
+    }
+
+    //microseconds until count tokens are there, after refill
+    uint64_t wait(double count) const {
+        return tokens >= count ? 0 : (uint64_t) ((count - tokens) / rate * 1e6);
+    }
+
+    //keeps the tokens it has, up to the new burst
+    void retune(double rate, double burst) {
+        refill(std::chrono::steady_clock::now());
+        this->rate = rate;
+        this->burst = burst;
+        tokens = std::min(tokens, burst);
+    }
+};
+
+/* Token buckets keyed by client address or destination host.
+ * A rule for a key applies to that key only, a rule for "" gives every other key a bucket of its own.
+ * Keys without a rule are not shaped and cost nothing. */
+class Shaper {
+    std::map<std::string, std::pair<double, double>, std::less<>> rules;
+    std::map<std::string, TokenBucket, std::less<>> buckets;
+
+public:
+    //buckets in use that the rule covers take its rate at once
+    void setRule(const std::string &key, double rate, double burst) {
+        rules[key] = std::make_pair(rate, burst);
+        for (auto &bucket : buckets) {
+            if (bucket.first == key || (key.empty() && rules.find(bucket.first) == rules.end())) {
+                bucket.second.retune(rate, burst);
+            }
+        }
+    }
+
+    //buckets in use stop limiting until a new rule covers them
+    void clearRules() {
+        rules.clear();
+        for (auto &bucket : buckets) {
+            bucket.second.retune(std::numeric_limits<double>::max(), std::numeric_limits<double>::max());
+        }
+    }
+
+    bool empty() const {
+        return rules.empty();
+    }
+
+    //whether acquire would hand out a bucket for the key
+    bool shapes(const char *key) const {
+        return !rules.empty() && (rules.find(key) != rules.end() || rules.find("") != rules.end());
+    }
+
+    //nullptr when the key is not shaped
+    TokenBucket *acquire(const char *key) {
+        if (rules.empty()) {
+            return nullptr;
+        }
+        auto bucket = buckets.find(key);
+        if (bucket == buckets.end()) {
+            auto rule = rules.find(key);
+            if (rule == rules.end() && (rule = rules.find("")) == rules.end()) {
+                return nullptr;
+            }
+            bucket = buckets.emplace(std::piecewise_construct, std::forward_as_tuple(key),
+                                     std::forward_as_tuple(rule->second.first, rule->second.second)).first;
+        }
+        ++bucket->second.users;
+        return &bucket->second;
+    }
+
+    static void release(TokenBucket *&bucket) {
+        if (bucket != nullptr) {
+            --bucket->users;
+            bucket = nullptr;
+        }
+    }
+
+    //drops buckets nobody draws from that have refilled, a returning key would get the same full bucket
+    bool sweep() {
+        auto now = std::chrono::steady_clock::now();
+        for (auto iter = buckets.begin(); iter != buckets.end();) {
+            iter->second.refill(now);
+            if (iter->second.users == 0 && iter->second.tokens >= iter->second.burst) {
+                iter = buckets.erase(iter);
+            } else {
+                ++iter;
+            }
+        }
+        return !buckets.empty();
+    }
+};
@@ -1,10 +1,62 @@
 #include "socket.h"
 #include <sys/socket.h>
+#include <netinet/in.h>
+//the kernel's tcp_info, the one of glibc ends before tcpi_busy_time
+#include <linux/tcp.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
 #include <fcntl.h>
 #include <iostream>
+#include <algorithm>
+#include <limits>
 
 using namespace std;
 
+static void setOption(int fd, int level, int name, int value) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        throw runtime_error("Unable to set socket option." + string(strerror(errno)));
+    }
+}
+
+//microseconds the send queue was not empty, 0 where the kernel does not report it
+static uint64_t busyTime(int fd) {
+    tcp_info info;
+    socklen_t length = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) < 0 ||
+        length < offsetof(tcp_info, tcpi_busy_time) + sizeof(info.tcpi_busy_time)) {
+        return 0;
+    }
+    return info.tcpi_busy_time;
+}
+
+void applyTcpProfile(int fd, const TcpProfile &profile) {
+    if (profile.noDelay) {
+        setOption(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    }
+    if (profile.sendBuffer > 0) {
+        setOption(fd, SOL_SOCKET, SO_SNDBUF, profile.sendBuffer);
+    }
+    if (profile.receiveBuffer > 0) {
+        setOption(fd, SOL_SOCKET, SO_RCVBUF, profile.receiveBuffer);
+    }
+    if (profile.notSentLowat > 0) {
+        setOption(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile.notSentLowat);
+    }
+    if (profile.keepAliveIdle > 0) {
+        setOption(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+        setOption(fd, IPPROTO_TCP, TCP_KEEPIDLE, profile.keepAliveIdle);
+        if (profile.keepAliveInterval > 0) {
+            setOption(fd, IPPROTO_TCP, TCP_KEEPINTVL, profile.keepAliveInterval);
+        }
+        if (profile.keepAliveCount > 0) {
+            setOption(fd, IPPROTO_TCP, TCP_KEEPCNT, profile.keepAliveCount);
+        }
+    }
+    if (profile.zeroCopyThreshold > 0) {
+        setOption(fd, SOL_SOCKET, SO_ZEROCOPY, 1);
+    }
+}
+
 
 void Socket::setMode(socketMode mode) {
     //assert(state == socketState::open);
@@ -25,12 +77,133 @@ socketState Socket::getState() const {
     return state;
 }
 
+void Socket::setPriority(socketPriority priority) {
+    this->priority = priority;
+    transferred = 0;
+}
+
+socketPriority Socket::getPriority() const {
+    return priority;
+}
+
+void Socket::applyProfile(const TcpProfile *profile) {
+    this->profile = profile;
+    window = 0;
+    zeroCopyThreshold = 0;
+    adaptive = false;
+    if (profile != nullptr) {
+        applyTcpProfile(fd, *profile);
+        zeroCopyThreshold = profile->zeroCopyThreshold;
+        adaptive = profile->adaptive;
+        adaptBytes = 0;
+        adaptBusy = adaptive ? busyTime(fd) : 0;
+    }
+}
+
+unsigned Socket::getWindow() const {
+    return window;
+}
+
+string Socket::getPeerAddress() const {
+    sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    char buffer[INET6_ADDRSTRLEN];
+    if (getpeername(fd, (sockaddr *) &address, &length) < 0) {
+        return string();
+    }
+    const void *raw = address.ss_family == AF_INET6 ? (const void *) &((sockaddr_in6 *) &address)->sin6_addr
+                                                    : (const void *) &((sockaddr_in *) &address)->sin_addr;
+    if (inet_ntop(address.ss_family, raw, buffer, sizeof(buffer)) == nullptr) {
+        return string();
+    }
+    return string(buffer);
+}
+
+bool Socket::peerGone() const {
+    char byte;
+    long count = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+unsigned long Socket::getPinned() const {
+    return pinned;
+}
+
+void Socket::completeZeroCopy() {
+    char control[128];
+    for (;;) {
+        msghdr message{};
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &message, MSG_ERRQUEUE) < 0) {
+            break;
+        }
+        for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+            if (!(header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) &&
+                !(header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            auto *error = (sock_extended_err *) CMSG_DATA(header);
+            if (error->ee_origin != SO_EE_ORIGIN_ZEROCOPY || error->ee_errno != 0) {
+                continue;
+            }
+            if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                //the kernel had to copy anyway (loopback, no scatter-gather), pinning only adds the notifications
+                zeroCopyThreshold = 0;
+            }
+            //an inclusive range of send calls, the counter wraps
+            for (auto &send : zeroCopyPending) {
+                if ((int32_t) (send.sequence - error->ee_info) >= 0 && (int32_t) (error->ee_data - send.sequence) >= 0) {
+                    send.done = true;
+                }
+            }
+        }
+    }
+
+    auto send = zeroCopyPending.begin();
+    for (; send != zeroCopyPending.end() && send->done; ++send) {
+        pinned -= send->size;
+        host->zeroCopySignalHolder(send->buffer, send->size);
+    }
+    zeroCopyPending.erase(zeroCopyPending.begin(), send);
+}
+
+void Socket::adapt() {
+    tcp_info info;
+    socklen_t length = sizeof(info);
+    //busy time excludes the idle gaps of a kept-alive connection, kernels before 4.10 do not report it
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0 &&
+        length >= offsetof(tcp_info, tcpi_busy_time) + sizeof(info.tcpi_busy_time) && info.tcpi_rtt > 0 &&
+        info.tcpi_busy_time > adaptBusy) {
+        //bandwidth-delay product from the measured throughput, doubled to keep the pipe full
+        unsigned long long bdp = 2ULL * adaptBytes * info.tcpi_rtt / (info.tcpi_busy_time - adaptBusy);
+        unsigned buffer = (unsigned) max<unsigned long long>(profile->minBuffer, min<unsigned long long>(bdp, profile->maxBuffer));
+        window = (unsigned) max<unsigned long long>(profile->minWindow, min<unsigned long long>(bdp, profile->maxWindow));
+        //the kernel doubles the size it is given and reports the doubled one
+        int current = 0;
+        socklen_t size = sizeof(current);
+        if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &current, &size) == 0 && 2ULL * buffer > (unsigned) current) {
+            try {
+                setOption(fd, SOL_SOCKET, SO_SNDBUF, buffer);
+            } catch (...) {
+                //keep the previous size
+            }
+        }
+        adaptBusy = info.tcpi_busy_time;
+    }
+    adaptBytes = 0;
+}
+
 unsigned Socket::read(char *buf, unsigned maxSize) {
     assert(state == socketState::open);
     unsigned total = 0;
     long counter;
-    while (total < maxSize) {
-        if ((counter = recv(fd, buf + total, maxSize - total, 0)) <= 0) {
+    bool limited = budgeted == socketMode::toRead;
+    unsigned bytes = limited ? budgetBytes : numeric_limits<unsigned>::max();
+    unsigned calls = limited ? budgetCalls : numeric_limits<unsigned>::max();
+    while (total < maxSize && bytes > 0 && calls > 0) {
+        --calls;
+        if ((counter = recv(fd, buf + total, min(maxSize - total, bytes), 0)) <= 0) {
             if (counter == 0) {
                 state = socketState::close;
                 break;
@@ -41,35 +214,73 @@ unsigned Socket::read(char *buf, unsigned maxSize) {
             throw runtime_error("Unable to read from the socket." + string(strerror(errno)));
         }
         total += counter;
+        bytes -= counter;
+    }
+    if (limited) {
+        budgetBytes = bytes;
+        budgetCalls = calls;
     }
 
+    transferred += total;
     return total;
 }
 
-unsigned Socket::write(char *data, unsigned size) {
+unsigned Socket::write(char *data, unsigned size, const char *buffer) {
     assert(state == socketState::open);
 
     unsigned total = 0;
     long counter;
-
-    while (total < size) {
-        if ((counter = send(fd, data + total, size - total, 0)) < 0) {
+    //replies written from a read event, a timer or another socket's event must not be cut by a spent budget
+    bool limited = budgeted == socketMode::toWrite;
+    unsigned bytes = limited ? budgetBytes : numeric_limits<unsigned>::max();
+    unsigned calls = limited ? budgetCalls : numeric_limits<unsigned>::max();
+
+    while (total < size && bytes > 0 && calls > 0) {
+        --calls;
+        unsigned chunk = min(size - total, bytes);
+        bool pin = buffer != nullptr && zeroCopyThreshold != 0 && chunk >= zeroCopyThreshold;
+        counter = send(fd, data + total, chunk, pin ? MSG_ZEROCOPY : 0);
+        if (counter < 0 && pin && errno == ENOBUFS) {
+            //out of option memory for pinned pages, this chunk is copied
+            pin = false;
+            counter = send(fd, data + total, chunk, 0);
+        }
+        if (counter < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 break;
             }
             state = socketState::error;
             throw runtime_error("Unable to write into the socket." + string(strerror(errno)));
         }
+        if (pin) {
+            //every successful zero-copy send takes the next number of the completion counter
+            zeroCopyPending.push_back(ZeroCopySend{zeroCopySequence++, buffer, (unsigned) counter, false});
+            pinned += counter;
+        }
         total += counter;
+        bytes -= counter;
+    }
+    if (limited) {
+        budgetBytes = bytes;
+        budgetCalls = calls;
     }
 
+    transferred += total;
+    if (adaptive && (adaptBytes += total) >= profile->adaptInterval) {
+        adapt();
+    }
     return total;
 }
 
 vector<SocketWrap> Socket::accept(unsigned maxCount = 0) {
+    vector<SocketWrap> accepted;
+    accept(maxCount, accepted);
+    return accepted;
+}
+
+void Socket::accept(unsigned maxCount, vector<SocketWrap> &accepted) {
     assert(state == socketState::open && mode == socketMode::toListen);
 
-    vector<SocketWrap> accepted;
     int currentFd;
 
     for (int i = 0; maxCount == 0 || i < maxCount; ++i) {
@@ -86,6 +297,11 @@ vector<SocketWrap> Socket::accept(unsigned maxCount = 0) {
             continue;
         }
         auto currentSocketPtr = host->addSocket(socketMode::none, socketState::open, currentFd);
+        try {
+            currentSocketPtr.lock()->applyProfile(profile);
+        } catch (...) {
+            //options are best effort, the connection still works with kernel defaults
+        }
         try {
             accepted.push_back(SocketWrap(currentSocketPtr));
         } catch (...) {
@@ -93,8 +309,6 @@ vector<SocketWrap> Socket::accept(unsigned maxCount = 0) {
             break;
         }
     }
-    return accepted;
-
 }
 
 
@@ -144,6 +358,36 @@ socketState SocketWrap::getState() const {
     return socketState::close;
 }
 
+void SocketWrap::setPriority(socketPriority priority) {
+    if (!sock.expired()) {
+        sock.lock()->setPriority(priority);
+    }
+}
+
+socketPriority SocketWrap::getPriority() const {
+    if (!sock.expired()) {
+        return sock.lock()->getPriority();
+    }
+
+    return socketPriority::normal;
+}
+
+string SocketWrap::getPeerAddress() const {
+    if (!sock.expired()) {
+        return sock.lock()->getPeerAddress();
+    }
+
+    return string();
+}
+
+bool SocketWrap::peerGone() const {
+    if (!sock.expired()) {
+        return sock.lock()->peerGone();
+    }
+
+    return true;
+}
+
 unsigned SocketWrap::read(char *buf, unsigned maxSize) {
     if (!sock.expired()) {
         return sock.lock()->read(buf, maxSize);
@@ -152,9 +396,9 @@ unsigned SocketWrap::read(char *buf, unsigned maxSize) {
     return 0;
 }
 
-unsigned SocketWrap::write(char *data, unsigned size) {
+unsigned SocketWrap::write(char *data, unsigned size, const char *buffer) {
     if (!sock.expired()) {
-        return sock.lock()->write(data, size);
+        return sock.lock()->write(data, size, buffer);
     }
 
     return 0;
@@ -168,6 +412,34 @@ std::vector<SocketWrap> SocketWrap::accept(unsigned maxCount) {
     return std::vector<SocketWrap>();
 }
 
+void SocketWrap::accept(unsigned maxCount, std::vector<SocketWrap> &accepted) {
+    if (!sock.expired()) {
+        sock.lock()->accept(maxCount, accepted);
+    }
+}
+
+void SocketWrap::applyProfile(const TcpProfile *profile) {
+    if (!sock.expired()) {
+        sock.lock()->applyProfile(profile);
+    }
+}
+
+unsigned SocketWrap::getWindow() const {
+    if (!sock.expired()) {
+        return sock.lock()->getWindow();
+    }
+
+    return 0;
+}
+
+unsigned long SocketWrap::getPinned() const {
+    if (!sock.expired()) {
+        return sock.lock()->getPinned();
+    }
+
+    return 0;
+}
+
 bool SocketWrap::isValid() const {
     return !sock.expired();
 }
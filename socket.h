@@ -1,6 +1,10 @@
 #pragma once
 
 #include "server.h"
+#include "pool.h"
+#include <chrono>
+#include <cstdint>
+#include <list>
 
 class Server;
 
@@ -12,6 +16,35 @@ enum class socketState {
     error, open, close, connecting
 };
 
+//order matters: Server::run serves ready sockets from high to bulk
+enum class socketPriority {
+    high, normal, bulk
+};
+
+/* Socket options applied when a socket is created or accepted.
+ * Zero leaves the kernel default in place. In adaptive mode the send buffer and the relay window are
+ * resized every adaptInterval bytes sent, from the RTT reported by TCP_INFO and the throughput over the
+ * time the send queue was busy, so high-BDP transfers can fill the pipe. A send buffer set by hand is no
+ * longer autotuned by the kernel, so it is only ever raised above what the kernel already chose. */
+struct TcpProfile {
+    bool noDelay = false;
+    int sendBuffer = 0, receiveBuffer = 0;
+    int notSentLowat = 0;
+    int keepAliveIdle = 0, keepAliveInterval = 0, keepAliveCount = 0;
+
+    bool adaptive = false;
+    unsigned adaptInterval = 1024 * 1024;
+    unsigned minBuffer = 64 * 1024, maxBuffer = 16 * 1024 * 1024;
+    unsigned minWindow = 256 * 1024, maxWindow = 10 * 1024 * 1024;
+
+    //writes of at least this many bytes go out with MSG_ZEROCOPY where the caller allows it, 0 disables;
+    //the kernel reads the memory after send returns, see Server::setZeroCopySlot
+    unsigned zeroCopyThreshold = 0;
+};
+
+//throws if an option is rejected; call before connect() so buffer sizes affect window scaling
+void applyTcpProfile(int fd, const TcpProfile& profile);
+
 class SocketWrap;
 
 class Socket {
@@ -24,6 +57,48 @@ public :
     int fd;
     Server* host;
     void* dataPtr;
+    socketPriority priority = socketPriority::normal;
+    //what is left of the per-event budget, refilled by Server::handleEvent before each slot call;
+    //it limits reads during a read event and writes during a write event, other calls are not limited
+    unsigned budgetBytes = 0, budgetCalls = 0;
+    socketMode budgeted = socketMode::none;
+    //bytes moved since the last setPriority, used to demote long transfers to bulk
+    unsigned long transferred = 0;
+    const TcpProfile* profile = nullptr;
+    //how much data a peer should buffer for this socket, 0 means unlimited
+    unsigned window = 0;
+    //taken from the profile when it is applied, like zeroCopyThreshold, so a reload leaves open sockets alone
+    bool adaptive = false;
+    //bytes sent and TCP_INFO busy time in microseconds at the start of the interval
+    unsigned long adaptBytes = 0;
+    uint64_t adaptBusy = 0;
+
+    void adapt();
+
+    //zero-copy sends the kernel has not reported done yet, oldest first
+    struct ZeroCopySend {
+        uint32_t sequence;
+        //the buffer given to write, the send lies inside it
+        const char* buffer;
+        unsigned size;
+        bool done;
+    };
+    //a vector does not allocate until the first zero-copy send
+    std::vector<ZeroCopySend> zeroCopyPending;
+    uint32_t zeroCopySequence = 0;
+    unsigned zeroCopyThreshold = 0;
+    unsigned long pinned = 0;
+    //draining: registered without events so that completions still arrive;
+    //lingering: closed, the descriptor is kept until the kernel is done with the memory;
+    //hungUp: out of epoll after a hangup, the rest of the completions are polled for
+    bool draining = false, lingering = false, lingerExpired = false, hungUp = false;
+
+    //reads the completions off the error queue and reports the sends that are done, in order
+    void completeZeroCopy();
+
+    //where the socket sits in Server::servedSockets, so removal does not search
+    std::list<std::shared_ptr<Socket>, PoolAllocator<std::shared_ptr<Socket>>>::iterator position;
+    bool removing = false;
 
 
     Socket(Server* host, socketMode mode, socketState state, int fd);
@@ -36,9 +111,25 @@ public :
     
     socketState getState() const;
 
+    void setPriority(socketPriority priority);
+    socketPriority getPriority() const;
+
+    void applyProfile(const TcpProfile* profile);
+    unsigned getWindow() const;
+    //numeric address of the remote end, empty if unknown
+    std::string getPeerAddress() const;
+    //the peer closed or reset the connection; looks at the input without taking any of it
+    bool peerGone() const;
+    //bytes of zero-copy sends the kernel may still read
+    unsigned long getPinned() const;
+
     unsigned read(char* buf, unsigned maxSize);
-    unsigned write(char* data, unsigned size);
+    //with a buffer given large chunks are sent from data in place, data lies inside buffer and must stay
+    //unchanged until the zero-copy slot releases it
+    unsigned write(char* data, unsigned size, const char* buffer = nullptr);
     std::vector<SocketWrap> accept(unsigned maxCount);
+    //appends to accepted, so the caller can reuse its storage
+    void accept(unsigned maxCount, std::vector<SocketWrap>& accepted);
 
     template<class T>
     T* getData() const;
@@ -71,9 +162,20 @@ public:
 
     socketState getState() const;
 
+    void setPriority(socketPriority priority);
+    socketPriority getPriority() const;
+
+    void applyProfile(const TcpProfile* profile);
+    unsigned getWindow() const;
+    //numeric address of the remote end, empty if unknown
+    std::string getPeerAddress() const;
+    bool peerGone() const;
+    unsigned long getPinned() const;
+
     unsigned read(char* buf, unsigned maxSize);
-    unsigned write(char* data, unsigned size);
+    unsigned write(char* data, unsigned size, const char* buffer = nullptr);
     std::vector<SocketWrap> accept(unsigned maxCount);
+    void accept(unsigned maxCount, std::vector<SocketWrap>& accepted);
 
     bool isValid() const;
     Socket& toSocket();
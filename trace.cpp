@@ -0,0 +1,140 @@
+#include "trace.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+//single producer (the owning thread), single consumer (the flush thread)
+struct Ring {
+    static const uint64_t size = 8192;
+
+    TraceRecord slots[size];
+    atomic<uint64_t> head{0}, tail{0};
+};
+
+mutex ringsMutex;
+vector<unique_ptr<Ring>> rings;
+
+thread_local Ring *localRing = nullptr;
+
+atomic<uint32_t> connectionCounter{0};
+atomic<uint64_t> dropped{0};
+
+int fileFd = -1;
+TraceHeader *header = nullptr;
+TraceRecord *records = nullptr;
+thread flusher;
+atomic<bool> stopping{false};
+
+void flush() {
+    lock_guard<mutex> lock(ringsMutex);
+    for (auto &ring : rings) {
+        uint64_t tail = ring->tail.load(memory_order_relaxed), head = ring->head.load(memory_order_acquire);
+        for (; tail != head; ++tail) {
+            records[header->written % header->capacity] = ring->slots[tail % Ring::size];
+            ++header->written;
+        }
+        ring->tail.store(tail, memory_order_release);
+    }
+    header->dropped = dropped.load(memory_order_relaxed);
+}
+
+void flushLoop() {
+    while (!stopping.load()) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+        flush();
+    }
+    flush();
+}
+
+}
+
+atomic<bool> Trace::active{false};
+
+uint64_t Trace::now() {
+    return (uint64_t) chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint32_t Trace::nextConnection() {
+    return connectionCounter.fetch_add(1, memory_order_relaxed) + 1;
+}
+
+void Trace::push(const TraceRecord &record) {
+    Ring *ring = localRing;
+    if (ring == nullptr) {
+        lock_guard<mutex> lock(ringsMutex);
+        rings.push_back(make_unique<Ring>());
+        ring = localRing = rings.back().get();
+    }
+
+    uint64_t head = ring->head.load(memory_order_relaxed);
+    if (head - ring->tail.load(memory_order_acquire) >= Ring::size) {
+        dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    ring->slots[head % Ring::size] = record;
+    ring->head.store(head + 1, memory_order_release);
+}
+
+void Trace::open(const string &path, uint64_t capacity) {
+    if (active.load() || capacity == 0) {
+        throw runtime_error("Trace is already open or empty.");
+    }
+
+    size_t length = sizeof(TraceHeader) + capacity * sizeof(TraceRecord);
+    if ((fileFd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        throw runtime_error("Unable to open trace file." + string(strerror(errno)));
+    }
+    void *mapped;
+    if (ftruncate(fileFd, length) < 0 ||
+        (mapped = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fileFd, 0)) == MAP_FAILED) {
+        ::close(fileFd);
+        fileFd = -1;
+        throw runtime_error("Unable to map trace file." + string(strerror(errno)));
+    }
+
+    header = (TraceHeader *) mapped;
+    records = (TraceRecord *) (header + 1);
+    memcpy(header->magic, "PXTR", 4);
+    header->version = version;
+    header->recordSize = sizeof(TraceRecord);
+    header->capacity = capacity;
+    header->written = 0;
+    header->dropped = 0;
+    header->startRealtime = (uint64_t) chrono::duration_cast<chrono::nanoseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+    header->startMonotonic = now();
+
+    stopping = false;
+    flusher = thread(flushLoop);
+    active = true;
+}
+
+void Trace::close() {
+    if (!active.exchange(false)) {
+        return;
+    }
+
+    stopping = true;
+    flusher.join();
+
+    size_t length = sizeof(TraceHeader) + header->capacity * sizeof(TraceRecord);
+    msync(header, length, MS_SYNC);
+    munmap(header, length);
+    ::close(fileFd);
+    header = nullptr;
+    records = nullptr;
+    fileFd = -1;
+}
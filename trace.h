@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/* Always-on binary event log.
+ * Every thread writes fixed-size records into its own lock-free ring, a background thread moves them
+ * into a memory-mapped file that is used as a circular buffer. tracedump turns the file into text or JSON.
+ * Recording is a relaxed load when tracing is off and a clock read plus a store when it is on;
+ * records are dropped (and counted) rather than blocking when a ring is full.
+ * A request record (version 2) sums up one finished request, see latency.h: time is its start, and
+ * bytesIn and bytesOut hold the uint16_t offsets of its eight latencyPhases from there in units of
+ * 2^pad nanoseconds, 0xffff for phases it did not reach. */
+
+enum class traceEvent : uint8_t {
+    accept, parsed, resolved, connected, firstByte, close, request
+};
+
+enum class traceReason : uint8_t {
+    none, done, closed, error, connectFailed, shed, denied
+};
+
+enum class traceSide : uint8_t {
+    client, upstream
+};
+
+struct TraceRecord {
+    uint64_t time;
+    uint32_t connection;
+    uint8_t event, reason, side, pad;
+    uint64_t bytesIn, bytesOut;
+};
+
+struct TraceHeader {
+    char magic[4];
+    uint32_t version, recordSize, pad;
+    uint64_t capacity, written, dropped;
+    //wall clock and monotonic clock at open, to turn record times into dates
+    uint64_t startRealtime, startMonotonic;
+};
+
+static_assert(sizeof(TraceRecord) == 32, "trace records are part of the file format");
+
+class Trace {
+    static std::atomic<bool> active;
+
+public:
+    static const uint32_t version = 2;
+
+    //capacity is in records; throws if the file cannot be mapped
+    static void open(const std::string &path, uint64_t capacity = 1 << 20);
+    static void close();
+
+    static bool enabled() {
+        return active.load(std::memory_order_relaxed);
+    }
+
+    static uint64_t now();
+    static uint32_t nextConnection();
+
+    static void record(traceEvent event, uint32_t connection, traceSide side, traceReason reason = traceReason::none,
+                       uint64_t bytesIn = 0, uint64_t bytesOut = 0) {
+        if (enabled()) {
+            push(TraceRecord{now(), connection, (uint8_t) event, (uint8_t) reason, (uint8_t) side, 0, bytesIn,
+                             bytesOut});
+        }
+    }
+
+    static void push(const TraceRecord &record);
+};
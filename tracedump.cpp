@@ -0,0 +1,102 @@
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include "trace.h"
+
+using namespace std;
+
+static const char *eventNames[] = {"accept", "parsed", "resolved", "connected", "first_byte", "close", "request"};
+static const char *reasonNames[] = {"none", "done", "closed", "error", "connect_failed", "shed", "denied"};
+static const char *sideNames[] = {"client", "upstream"};
+static const char *phaseNames[] = {"accept", "request_byte", "parsed", "resolved", "connected", "first_byte",
+                                   "last_byte", "close"};
+
+static const char *lookup(const char *const *names, unsigned count, unsigned value) {
+    return value < count ? names[value] : "unknown";
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[2], "--json") != 0)) {
+        cout << "Usage: [trace file] [--json]\n";
+        return 0;
+    }
+    bool json = argc == 3;
+
+    ifstream file(argv[1], ios::binary);
+    TraceHeader header;
+    if (!file.read((char *) &header, sizeof(header)) || memcmp(header.magic, "PXTR", 4) != 0 ||
+        header.version == 0 || header.version > Trace::version || header.recordSize != sizeof(TraceRecord)) {
+        cerr << "Not a trace file or unsupported version.\n";
+        return 1;
+    }
+
+    uint64_t count = min(header.written, header.capacity);
+    vector<TraceRecord> records(count);
+    if (!file.read((char *) records.data(), count * sizeof(TraceRecord))) {
+        cerr << "Trace file is truncated.\n";
+        return 1;
+    }
+    //the file is a circular buffer and every thread flushes in batches, order by time
+    stable_sort(records.begin(), records.end(), [](const TraceRecord &a, const TraceRecord &b) {
+        return a.time < b.time;
+    });
+
+    if (!json) {
+        cout << "# " << header.written << " records, " << count << " kept, " << header.dropped << " dropped\n";
+    }
+    for (auto &record : records) {
+        //nanoseconds since the epoch, derived from the clocks sampled at open
+        uint64_t time = header.startRealtime + (record.time - header.startMonotonic);
+        const char *event = lookup(eventNames, sizeof(eventNames) / sizeof(*eventNames), record.event);
+        const char *reason = lookup(reasonNames, sizeof(reasonNames) / sizeof(*reasonNames), record.reason);
+        const char *side = lookup(sideNames, sizeof(sideNames) / sizeof(*sideNames), record.side);
+        if (record.event == (uint8_t) traceEvent::request) {
+            //microseconds after the start of the request, -1 for phases it did not reach
+            uint16_t phases[8];
+            memcpy(phases, &record.bytesIn, sizeof(phases));
+            long offsets[8];
+            for (unsigned i = 0; i < 8; ++i) {
+                offsets[i] = phases[i] == 0xffff ? -1 : (long) (((uint64_t) phases[i] << record.pad) / 1000);
+            }
+            if (json) {
+                cout << "{\"time\":" << time << ",\"connection\":" << record.connection
+                     << ",\"event\":\"request\",\"reason\":\"" << reason << "\"";
+                for (unsigned i = 1; i < 8; ++i) {
+                    cout << ",\"" << phaseNames[i] << "\":" << offsets[i];
+                }
+                cout << "}\n";
+            } else {
+                cout << time / 1000000000 << '.';
+                cout.width(9);
+                cout.fill('0');
+                cout << time % 1000000000 << ' ' << record.connection << " client request " << reason;
+                for (unsigned i = 1; i < 8; ++i) {
+                    cout << ' ' << phaseNames[i] << '=';
+                    if (offsets[i] < 0) {
+                        cout << '-';
+                    } else {
+                        cout << offsets[i] << "us";
+                    }
+                }
+                cout << '\n';
+            }
+        } else if (json) {
+            cout << "{\"time\":" << time << ",\"connection\":" << record.connection << ",\"side\":\"" << side
+                 << "\",\"event\":\"" << event << "\",\"reason\":\"" << reason << "\",\"in\":" << record.bytesIn
+                 << ",\"out\":" << record.bytesOut << "}\n";
+        } else {
+            cout << time / 1000000000 << '.';
+            cout.width(9);
+            cout.fill('0');
+            cout << time % 1000000000 << ' ' << record.connection << ' ' << side << ' ' << event;
+            if (record.event == (uint8_t) traceEvent::close) {
+                cout << ' ' << reason << " in=" << record.bytesIn << " out=" << record.bytesOut;
+            } else if (record.bytesIn != 0 || record.bytesOut != 0) {
+                cout << " in=" << record.bytesIn << " out=" << record.bytesOut;
+            }
+            cout << '\n';
+        }
+    }
+}